@@ -0,0 +1,797 @@
+/*
+ * KUnit tests for the Corsair HID driver
+ *
+ * Tests of the parts of the driver that do not need a keyboard. This file
+ * is included at the end of hid-corsair.c when K90_KUNIT is defined (see
+ * Kconfig and Makefile), so that it can test its static functions.
+ *
+ * Copyright (c) 2015 Clement Vuchener
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <kunit/test.h>
+
+/*
+ * Usage table
+ */
+
+/* The usages listed in hid_usage_codes.md */
+static const struct {
+	u8 usage;
+	u8 class;
+	u8 index;
+} corsair_test_usages[] = {
+	{ 0xd0, CORSAIR_CLASS_GKEY, 0 },	/* G1 */
+	{ 0xd1, CORSAIR_CLASS_GKEY, 1 },
+	{ 0xd2, CORSAIR_CLASS_GKEY, 2 },
+	{ 0xd3, CORSAIR_CLASS_GKEY, 3 },
+	{ 0xd4, CORSAIR_CLASS_GKEY, 4 },
+	{ 0xd5, CORSAIR_CLASS_GKEY, 5 },
+	{ 0xd6, CORSAIR_CLASS_GKEY, 6 },
+	{ 0xd7, CORSAIR_CLASS_GKEY, 7 },
+	{ 0xd8, CORSAIR_CLASS_GKEY, 8 },
+	{ 0xd9, CORSAIR_CLASS_GKEY, 9 },
+	{ 0xda, CORSAIR_CLASS_GKEY, 10 },
+	{ 0xdb, CORSAIR_CLASS_GKEY, 11 },
+	{ 0xdc, CORSAIR_CLASS_GKEY, 12 },
+	{ 0xdd, CORSAIR_CLASS_GKEY, 13 },
+	{ 0xde, CORSAIR_CLASS_GKEY, 14 },
+	{ 0xdf, CORSAIR_CLASS_GKEY, 15 },
+	{ 0xe8, CORSAIR_CLASS_GKEY, 16 },	/* G17 */
+	{ 0xe9, CORSAIR_CLASS_GKEY, 17 },	/* G18 */
+	{ 0xf1, CORSAIR_CLASS_PROFILE, 0 },	/* M1 */
+	{ 0xf2, CORSAIR_CLASS_PROFILE, 1 },
+	{ 0xf3, CORSAIR_CLASS_PROFILE, 2 },
+	{ 0xf4, CORSAIR_CLASS_META, 0 },	/* Meta key lock off */
+	{ 0xf5, CORSAIR_CLASS_META, 1 },
+	{ 0xf6, CORSAIR_CLASS_RECORD, 0 },	/* MR start */
+	{ 0xf7, CORSAIR_CLASS_RECORD, 1 },	/* MR stop */
+	{ 0xfa, CORSAIR_CLASS_LIGHT, 0 },	/* Light off */
+	{ 0xfb, CORSAIR_CLASS_LIGHT, 1 },
+	{ 0xfc, CORSAIR_CLASS_LIGHT, 2 },
+	{ 0xfd, CORSAIR_CLASS_LIGHT, 3 },	/* Light 100% */
+};
+
+static void corsair_test_usage_codes(struct kunit *test)
+{
+	const struct corsair_usage_info *info;
+	unsigned int usage;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(corsair_test_usages); i++) {
+		usage = corsair_test_usages[i].usage;
+		info = corsair_usage_info(HID_UP_KEYBOARD | usage);
+		KUNIT_EXPECT_EQ_MSG(test, info->class,
+				    corsair_test_usages[i].class,
+				    "usage 0x%02x", usage);
+		KUNIT_EXPECT_EQ_MSG(test, info->index,
+				    corsair_test_usages[i].index,
+				    "usage 0x%02x", usage);
+	}
+}
+
+static void corsair_test_gkey_usages(struct kunit *test)
+{
+	int i;
+
+	/* G1-G16 are contiguous, G17 and G18 are after the modifiers */
+	for (i = 0; i < 16; i++)
+		KUNIT_EXPECT_EQ(test,
+				corsair_class_usage(CORSAIR_CLASS_GKEY, i),
+				0xd0 + i);
+	KUNIT_EXPECT_EQ(test, corsair_class_usage(CORSAIR_CLASS_GKEY, 16),
+			0xe8);
+	KUNIT_EXPECT_EQ(test, corsair_class_usage(CORSAIR_CLASS_GKEY, 17),
+			0xe9);
+	KUNIT_EXPECT_EQ(test,
+			corsair_class_usage(CORSAIR_CLASS_GKEY, K90_GKEY_COUNT),
+			-1);
+}
+
+static void corsair_test_unknown_usages(struct kunit *test)
+{
+	int usage;
+
+	/* Regular keys, including the modifiers between G16 and G17 */
+	for (usage = 0; usage < 0xd0; usage++)
+		KUNIT_EXPECT_EQ_MSG(test,
+				    corsair_usage_info(HID_UP_KEYBOARD |
+						       usage)->class,
+				    CORSAIR_CLASS_NONE, "usage 0x%02x", usage);
+	for (usage = 0xe0; usage < 0xe8; usage++)
+		KUNIT_EXPECT_EQ_MSG(test,
+				    corsair_usage_info(HID_UP_KEYBOARD |
+						       usage)->class,
+				    CORSAIR_CLASS_NONE, "usage 0x%02x", usage);
+
+	/* Outside of the table or of the keyboard page */
+	KUNIT_EXPECT_EQ(test,
+			corsair_usage_info(HID_UP_KEYBOARD | 0x100)->class,
+			CORSAIR_CLASS_NONE);
+	KUNIT_EXPECT_EQ(test, corsair_usage_info(HID_UP_CONSUMER | 0xd0)->class,
+			CORSAIR_CLASS_NONE);
+	KUNIT_EXPECT_EQ(test, corsair_usage_info(HID_UP_CONSUMER | 0xf1)->class,
+			CORSAIR_CLASS_NONE);
+}
+
+/*
+ * Profile validation
+ */
+
+/* One macro binding pressing and releasing A, played once */
+static const u8 corsair_test_profile[] = {
+	/* Bindings header: count, bindings size, macro data size */
+	0x01, 0x00, 0x0a, 0x00, 0x09,
+	/* Binding 1: macro at offset 0, 9 bytes */
+	K90_BINDING_MACRO, 0x00, 0x00, 0x00, 0x09,
+	/* Macro data */
+	K90_MACRO_ITEM_KEY, 0x04, 0x01,
+	K90_MACRO_ITEM_KEY, 0x04, 0x00,
+	K90_MACRO_ITEM_END, 0x00, 0x01,
+	/* Key roles: count, then one key played once */
+	0x01, 0x00, K90_PLAYBACK_ONCE,
+};
+
+#define CORSAIR_TEST_BINDING	K90_BINDINGS_HEADER_SIZE
+#define CORSAIR_TEST_MACRO	(K90_BINDINGS_HEADER_SIZE + K90_BINDING_SIZE)
+
+static u8 *corsair_test_profile_copy(struct kunit *test)
+{
+	u8 *profile = kunit_kmalloc(test, sizeof(corsair_test_profile),
+				    GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, profile);
+	memcpy(profile, corsair_test_profile, sizeof(corsair_test_profile));
+	return profile;
+}
+
+static int corsair_test_validate(struct kunit *test, const u8 *profile,
+				 size_t size,
+				 struct k90_profile_layout *layout)
+{
+	struct k90_report report = {
+		.size = PAGE_SIZE,
+	};
+
+	report.buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, report.buf);
+
+	return k90_validate_profile((const char *)profile, size, layout,
+				    &report);
+}
+
+static void corsair_test_profile_valid(struct kunit *test)
+{
+	struct k90_profile_layout layout;
+
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, corsair_test_profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 0);
+	KUNIT_EXPECT_EQ(test, layout.bindings_size, 10);
+	KUNIT_EXPECT_EQ(test, layout.macro_data_size, 9);
+	KUNIT_EXPECT_EQ(test, layout.key_roles_size, 3);
+}
+
+static void corsair_test_profile_truncated_header(struct kunit *test)
+{
+	struct k90_profile_layout layout;
+
+	KUNIT_EXPECT_EQ(test, corsair_test_validate(test, corsair_test_profile,
+						    K90_BINDINGS_HEADER_SIZE -
+						    1, &layout), 1);
+	KUNIT_EXPECT_EQ(test, corsair_test_validate(test, corsair_test_profile,
+						    0, &layout), 1);
+	/* Truncated after the macro data, before the key roles */
+	KUNIT_EXPECT_EQ(test, corsair_test_validate(test, corsair_test_profile,
+						    CORSAIR_TEST_MACRO + 9,
+						    &layout), 1);
+}
+
+static void corsair_test_profile_bad_item(struct kunit *test)
+{
+	struct k90_profile_layout layout;
+	u8 *profile = corsair_test_profile_copy(test);
+
+	profile[CORSAIR_TEST_MACRO + K90_MACRO_ITEM_SIZE] = 0x85;
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 1);
+}
+
+static void corsair_test_profile_after_end(struct kunit *test)
+{
+	struct k90_profile_layout layout;
+	u8 *profile = corsair_test_profile_copy(test);
+
+	/* End item in the middle, followed by a key item */
+	memcpy(&profile[CORSAIR_TEST_MACRO + K90_MACRO_ITEM_SIZE],
+	       (const u8[]){ K90_MACRO_ITEM_END, 0x00, 0x01,
+			     K90_MACRO_ITEM_KEY, 0x04, 0x00 },
+	       2 * K90_MACRO_ITEM_SIZE);
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 1);
+}
+
+static void corsair_test_profile_bad_length(struct kunit *test)
+{
+	struct k90_profile_layout layout;
+	u8 *profile = corsair_test_profile_copy(test);
+
+	put_unaligned_be16(0, &profile[CORSAIR_TEST_BINDING + 3]);
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 1);
+
+	put_unaligned_be16(K90_MACRO_MAX_SIZE + 1,
+			   &profile[CORSAIR_TEST_BINDING + 3]);
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 1);
+}
+
+static void corsair_test_profile_bad_offset(struct kunit *test)
+{
+	struct k90_profile_layout layout;
+	u8 *profile = corsair_test_profile_copy(test);
+
+	/* Starts inside the macro data but ends after it */
+	put_unaligned_be16(K90_MACRO_ITEM_SIZE,
+			   &profile[CORSAIR_TEST_BINDING + 1]);
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 1);
+
+	/* Starts after the macro data */
+	put_unaligned_be16(9, &profile[CORSAIR_TEST_BINDING + 1]);
+	put_unaligned_be16(K90_MACRO_ITEM_SIZE,
+			   &profile[CORSAIR_TEST_BINDING + 3]);
+	KUNIT_EXPECT_EQ(test,
+			corsair_test_validate(test, profile,
+					      sizeof(corsair_test_profile),
+					      &layout), 1);
+}
+
+/*
+ * Recorded macro encoding
+ */
+
+static struct k90_recorder *corsair_test_recorder(struct kunit *test,
+						  unsigned int count,
+						  unsigned int delay_ms)
+{
+	struct k90_recorder *rec;
+	int i;
+
+	rec = kunit_kzalloc(test, sizeof(*rec), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, rec);
+	for (i = 0; i < count; i++) {
+		rec->events[i].time = (u64)i * delay_ms * NSEC_PER_MSEC;
+		rec->events[i].usage = 0x04 + i / 2;
+		rec->events[i].pressed = !(i % 2);
+	}
+	rec->count = count;
+	return rec;
+}
+
+/*
+ * Check that the encoded macro has the first count events of rec with
+ * their delays, and that it is accepted by the profile validation.
+ */
+static void corsair_test_check_macro(struct kunit *test,
+				     const struct k90_recorder *rec,
+				     const u8 *macro, size_t len,
+				     unsigned int count, unsigned int delay_ms)
+{
+	struct k90_report report = {
+		.size = PAGE_SIZE,
+	};
+	unsigned int pos = 0, i;
+
+	for (i = 0; i < count; i++) {
+		if (i > 0 && delay_ms > 0) {
+			KUNIT_EXPECT_EQ(test, macro[pos], K90_MACRO_ITEM_DELAY);
+			KUNIT_EXPECT_EQ(test,
+					get_unaligned_be16(&macro[pos + 1]),
+					delay_ms);
+			pos += K90_MACRO_ITEM_SIZE;
+		}
+		KUNIT_EXPECT_EQ(test, macro[pos], K90_MACRO_ITEM_KEY);
+		KUNIT_EXPECT_EQ(test, macro[pos + 1], rec->events[i].usage);
+		KUNIT_EXPECT_EQ(test, macro[pos + 2], rec->events[i].pressed);
+		pos += K90_MACRO_ITEM_SIZE;
+	}
+	KUNIT_EXPECT_EQ(test, macro[pos], K90_MACRO_ITEM_END);
+	KUNIT_EXPECT_EQ(test, get_unaligned_be16(&macro[pos + 1]), 1);
+	KUNIT_EXPECT_EQ(test, pos + K90_MACRO_ITEM_SIZE, len);
+
+	report.buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, report.buf);
+	k90_validate_macro(macro, len, 1, &report);
+	KUNIT_EXPECT_EQ(test, report.count, 0);
+}
+
+static void corsair_test_record_encode(struct kunit *test)
+{
+	struct k90_recorder *rec = corsair_test_recorder(test, 6, 25);
+	u8 *macro = kunit_kzalloc(test, K90_RECORD_MAX_SIZE, GFP_KERNEL);
+	bool truncated;
+	size_t len;
+
+	KUNIT_ASSERT_NOT_NULL(test, macro);
+	len = k90_record_encode(rec, macro, &truncated);
+	KUNIT_EXPECT_FALSE(test, truncated);
+	corsair_test_check_macro(test, rec, macro, len, 6, 25);
+}
+
+static void corsair_test_record_encode_empty(struct kunit *test)
+{
+	struct k90_recorder *rec = corsair_test_recorder(test, 0, 0);
+	u8 *macro = kunit_kzalloc(test, K90_RECORD_MAX_SIZE, GFP_KERNEL);
+	bool truncated;
+	size_t len;
+
+	KUNIT_ASSERT_NOT_NULL(test, macro);
+	len = k90_record_encode(rec, macro, &truncated);
+	KUNIT_EXPECT_FALSE(test, truncated);
+	corsair_test_check_macro(test, rec, macro, len, 0, 0);
+}
+
+static void corsair_test_record_encode_truncated(struct kunit *test)
+{
+	struct k90_recorder *rec;
+	u8 *macro = kunit_kzalloc(test, K90_RECORD_MAX_SIZE, GFP_KERNEL);
+	bool truncated;
+	size_t len;
+
+	KUNIT_ASSERT_NOT_NULL(test, macro);
+
+	/* 42 items of 3 bytes fit in 128 bytes: 41 keys and the end */
+	rec = corsair_test_recorder(test, 100, 0);
+	len = k90_record_encode(rec, macro, &truncated);
+	KUNIT_EXPECT_TRUE(test, truncated);
+	corsair_test_check_macro(test, rec, macro, len, 41, 0);
+
+	/* With delays: 21 keys, 20 delays and the end */
+	rec = corsair_test_recorder(test, 100, 10);
+	len = k90_record_encode(rec, macro, &truncated);
+	KUNIT_EXPECT_TRUE(test, truncated);
+	corsair_test_check_macro(test, rec, macro, len, 21, 10);
+
+	/* Exactly the largest macro */
+	rec = corsair_test_recorder(test, 41, 0);
+	len = k90_record_encode(rec, macro, &truncated);
+	KUNIT_EXPECT_FALSE(test, truncated);
+	KUNIT_EXPECT_LE(test, len, K90_MACRO_MAX_SIZE);
+	corsair_test_check_macro(test, rec, macro, len, 41, 0);
+}
+
+/*
+ * Attribute parsing
+ */
+
+static void corsair_test_parse_keycodes(struct kunit *test)
+{
+	static const u16 expected[] = { KEY_A, KEY_B, KEY_MACRO1, KEY_MAX };
+	u16 keycodes[ARRAY_SIZE(expected)];
+	char buf[64], out[64];
+	size_t len = 0;
+	int i;
+
+	snprintf(buf, sizeof(buf), "%u, 0x%x ,%u,%u\n", KEY_A, KEY_B,
+		 KEY_MACRO1, KEY_MAX);
+	KUNIT_ASSERT_EQ(test, corsair_parse_keycodes(buf, keycodes,
+						     ARRAY_SIZE(keycodes)), 0);
+	KUNIT_EXPECT_MEMEQ(test, keycodes, expected, sizeof(expected));
+
+	/* Written back in the format of the keymap attributes */
+	for (i = 0; i < ARRAY_SIZE(keycodes); i++)
+		len += snprintf(out + len, sizeof(out) - len, "%s%u",
+				i > 0 ? "," : "", keycodes[i]);
+	memset(keycodes, 0, sizeof(keycodes));
+	KUNIT_ASSERT_EQ(test, corsair_parse_keycodes(out, keycodes,
+						     ARRAY_SIZE(keycodes)), 0);
+	KUNIT_EXPECT_MEMEQ(test, keycodes, expected, sizeof(expected));
+}
+
+static void corsair_test_parse_keycodes_invalid(struct kunit *test)
+{
+	static const char *const invalid[] = {
+		"1,2",		/* Too few */
+		"1,2,3,4,5",	/* Too many */
+		"1,,3,4",
+		"1,x,3,4",
+		"1,2,3,-4",
+		"1,2,3,1000",	/* Greater than KEY_MAX */
+		"",
+	};
+	u16 keycodes[4];
+	char buf[32];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+		strscpy(buf, invalid[i], sizeof(buf));
+		KUNIT_EXPECT_EQ_MSG(test,
+				    corsair_parse_keycodes(buf, keycodes, 4),
+				    -EINVAL, "\"%s\"", invalid[i]);
+	}
+}
+
+/* Parse a bundle and show it again from the slot of profile 1 */
+static void corsair_test_bundle_round_trip(struct kunit *test,
+					   const char *in, const char *out)
+{
+	struct corsair_drvdata *drvdata;
+	struct k90_drvdata *k90;
+	struct k90_bundle *bundle;
+	struct device dev = {};
+	char *str, *buf;
+
+	drvdata = kunit_kzalloc(test, sizeof(*drvdata), GFP_KERNEL);
+	k90 = kunit_kzalloc(test, sizeof(*k90), GFP_KERNEL);
+	bundle = kunit_kzalloc(test, sizeof(*bundle), GFP_KERNEL);
+	str = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, drvdata);
+	KUNIT_ASSERT_NOT_NULL(test, k90);
+	KUNIT_ASSERT_NOT_NULL(test, bundle);
+	KUNIT_ASSERT_NOT_NULL(test, str);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	strscpy(str, in, PAGE_SIZE);
+	KUNIT_ASSERT_EQ(test, k90_parse_bundle(str, bundle), 0);
+
+	drvdata->k90 = k90;
+	dev_set_drvdata(&dev, drvdata);
+	RCU_INIT_POINTER(k90->bundles[0], bundle);
+	k90_show_bundle(&dev, 1, buf);
+	RCU_INIT_POINTER(k90->bundles[0], NULL);
+
+	KUNIT_EXPECT_STREQ(test, buf, out);
+}
+
+static void corsair_test_parse_bundle(struct kunit *test)
+{
+	static const char full[] =
+		"gkey_codes=1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18\n"
+		"brightness=2\n"
+		"macro_mode=SW\n";
+
+	corsair_test_bundle_round_trip(test, full, full);
+	/* Any order and separator, shown in the canonical form */
+	corsair_test_bundle_round_trip(test,
+		"macro_mode=HW brightness=0",
+		"brightness=0\nmacro_mode=HW\n");
+	corsair_test_bundle_round_trip(test, "\n", "");
+}
+
+static void corsair_test_parse_bundle_gkeys(struct kunit *test)
+{
+	struct k90_bundle *bundle;
+	char str[] = "gkey_codes=30,31,32,33,34,35,36,37,38,39,40,41,42,43,"
+		     "44,45,46,47";
+	u32 scancode;
+	int i;
+
+	bundle = kunit_kzalloc(test, sizeof(*bundle), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, bundle);
+	KUNIT_ASSERT_EQ(test, k90_parse_bundle(str, bundle), 0);
+	KUNIT_EXPECT_EQ(test, bundle->fields, K90_BUNDLE_GKEYS);
+
+	/* Entries ready for input_set_keycode(), with the G-key usages */
+	for (i = 0; i < K90_GKEY_COUNT; i++) {
+		memcpy(&scancode, bundle->gkeys[i].scancode, sizeof(scancode));
+		KUNIT_EXPECT_EQ(test, scancode, HID_UP_KEYBOARD |
+				corsair_class_usage(CORSAIR_CLASS_GKEY, i));
+		KUNIT_EXPECT_EQ(test, bundle->gkeys[i].keycode, 30 + i);
+	}
+}
+
+static void corsair_test_parse_bundle_invalid(struct kunit *test)
+{
+	static const char *const invalid[] = {
+		"brightness=4",
+		"brightness=-1",
+		"macro_mode=FW",
+		"unknown=1",
+		"brightness",
+		"gkey_codes=1,2,3",
+	};
+	struct k90_bundle *bundle;
+	char buf[64];
+	int i;
+
+	bundle = kunit_kzalloc(test, sizeof(*bundle), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, bundle);
+	for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+		strscpy(buf, invalid[i], sizeof(buf));
+		memset(bundle, 0, sizeof(*bundle));
+		KUNIT_EXPECT_EQ_MSG(test, k90_parse_bundle(buf, bundle),
+				    -EINVAL, "\"%s\"", invalid[i]);
+	}
+}
+
+/*
+ * Input mapping and events
+ */
+
+/* An interface of a keyboard, without USB device or input device */
+struct corsair_test_device {
+	struct hid_device hdev;
+	struct hid_input hidinput;
+	struct input_dev input;
+	struct corsair_drvdata drvdata;
+};
+
+static struct corsair_test_device *
+corsair_test_device(struct kunit *test, int ifnum)
+{
+	struct corsair_test_device *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, t);
+
+	/* For the trace event */
+	t->hdev.dev.init_name = "hid-corsair-test";
+	t->hidinput.input = &t->input;
+	t->drvdata.ifnum = ifnum;
+	t->drvdata.hdev = &t->hdev;
+	t->drvdata.brightness = -1;
+	t->drvdata.current_profile = -1;
+	t->drvdata.macro_mode = -1;
+	hid_set_drvdata(&t->hdev, &t->drvdata);
+
+	return t;
+}
+
+static int corsair_test_map(struct corsair_test_device *t, unsigned int usage,
+			    struct hid_usage *hid_usage)
+{
+	unsigned long *bit = NULL;
+	int max = 0;
+
+	memset(hid_usage, 0, sizeof(*hid_usage));
+	hid_usage->hid = HID_UP_KEYBOARD | usage;
+	return corsair_input_mapping(&t->hdev, &t->hidinput, NULL, hid_usage,
+				     &bit, &max);
+}
+
+static int corsair_test_event(struct corsair_test_device *t,
+			      unsigned int usage, __s32 value)
+{
+	struct hid_usage hid_usage = { .hid = HID_UP_KEYBOARD | usage };
+
+	return corsair_event(&t->hdev, NULL, &hid_usage, value);
+}
+
+static void corsair_test_map_class(struct kunit *test,
+				   struct corsair_test_device *t,
+				   enum corsair_usage_class class,
+				   const unsigned short *keycodes,
+				   unsigned int count)
+{
+	struct hid_usage hid_usage;
+	unsigned int usage;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		usage = corsair_class_usage(class, i);
+		KUNIT_EXPECT_EQ_MSG(test, corsair_test_map(t, usage, &hid_usage),
+				    1, "usage 0x%02x", usage);
+		KUNIT_EXPECT_EQ_MSG(test, hid_usage.type, EV_KEY,
+				    "usage 0x%02x", usage);
+		KUNIT_EXPECT_EQ_MSG(test, hid_usage.code, keycodes[i],
+				    "usage 0x%02x", usage);
+	}
+}
+
+static void corsair_test_input_mapping(struct kunit *test)
+{
+	struct corsair_test_device *t = corsair_test_device(test, 0);
+	struct hid_usage hid_usage;
+	unsigned int usage;
+
+	/* The special keys get the key codes of the module parameters */
+	corsair_test_map_class(test, t, CORSAIR_CLASS_GKEY, corsair_gkey_map,
+			       K90_GKEY_COUNT);
+	KUNIT_EXPECT_PTR_EQ(test, t->drvdata.input, &t->input);
+	corsair_test_map_class(test, t, CORSAIR_CLASS_RECORD,
+			       corsair_record_keycodes,
+			       ARRAY_SIZE(corsair_record_keycodes));
+	corsair_test_map_class(test, t, CORSAIR_CLASS_PROFILE,
+			       corsair_profile_keycodes,
+			       ARRAY_SIZE(corsair_profile_keycodes));
+
+	/* Meta, Light and the unused special usages are ignored */
+	for (usage = 0xf0; usage <= 0xff; usage++) {
+		switch (corsair_usage_info(HID_UP_KEYBOARD | usage)->class) {
+		case CORSAIR_CLASS_META:
+		case CORSAIR_CLASS_LIGHT:
+		case CORSAIR_CLASS_HIDDEN:
+			KUNIT_EXPECT_EQ_MSG(test,
+					    corsair_test_map(t, usage,
+							     &hid_usage),
+					    -1, "usage 0x%02x", usage);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Regular keys are left to the HID core */
+	KUNIT_EXPECT_EQ(test, corsair_test_map(t, 0x04, &hid_usage), 0);
+	KUNIT_EXPECT_EQ(test, corsair_test_map(t, 0xe0, &hid_usage), 0);
+	KUNIT_EXPECT_EQ(test, hid_usage.code, 0);
+}
+
+static void corsair_test_event_other_interfaces(struct kunit *test)
+{
+	struct corsair_test_device *t;
+	int ifnum;
+
+	/* Special usages are only handled on interface 0 */
+	for (ifnum = 1; ifnum <= K90_RECORD_IFNUM; ifnum++) {
+		t = corsair_test_device(test, ifnum);
+		KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_M2,
+							 1), 0);
+		KUNIT_EXPECT_EQ(test, corsair_test_event(t,
+					CORSAIR_USAGE_LIGHT_DIM, 1), 0);
+		KUNIT_EXPECT_EQ(test, t->drvdata.current_profile, -1);
+		KUNIT_EXPECT_EQ(test, t->drvdata.brightness, -1);
+	}
+}
+
+static void corsair_test_event_state(struct kunit *test)
+{
+	struct corsair_test_device *t = corsair_test_device(test, 0);
+
+	/*
+	 * The keyboard reports the profile and brightness it switched to,
+	 * the cached status no longer has them
+	 */
+	t->drvdata.status.valid = true;
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_M2, 1), 0);
+	KUNIT_EXPECT_EQ(test, t->drvdata.current_profile, 2);
+	KUNIT_EXPECT_FALSE(test, t->drvdata.status.valid);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_M3, 0), 0);
+	KUNIT_EXPECT_EQ(test, t->drvdata.current_profile, 2);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_M3, 1), 0);
+	KUNIT_EXPECT_EQ(test, t->drvdata.current_profile, 3);
+
+	t->drvdata.status.valid = true;
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_LIGHT_OFF,
+						 1), 0);
+	KUNIT_EXPECT_EQ(test, t->drvdata.brightness, 0);
+	KUNIT_EXPECT_FALSE(test, t->drvdata.status.valid);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_LIGHT_BRIGHT,
+						 1), 0);
+	KUNIT_EXPECT_EQ(test, t->drvdata.brightness, 3);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, CORSAIR_USAGE_LIGHT_DIM,
+						 0), 0);
+	KUNIT_EXPECT_EQ(test, t->drvdata.brightness, 3);
+
+	/* A status read afterwards does not replace the tracked values */
+	KUNIT_EXPECT_EQ(test, k90_track_value(&t->drvdata.brightness, 1), 3);
+	KUNIT_EXPECT_EQ(test, t->drvdata.brightness, 3);
+	t->drvdata.brightness = -1;
+	KUNIT_EXPECT_EQ(test, k90_track_value(&t->drvdata.brightness, 1), 1);
+	KUNIT_EXPECT_EQ(test, t->drvdata.brightness, 1);
+
+	/* Without the K90 macro functions, G keys are ordinary keys */
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, 0xd0, 1), 0);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, 0xd0, 0), 0);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, 0x04, 1), 0);
+}
+
+static void corsair_test_event_record(struct kunit *test)
+{
+	struct corsair_test_device *t = corsair_test_device(test, 0);
+	struct k90_drvdata *k90;
+
+	k90 = kunit_kzalloc(test, sizeof(*k90), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, k90);
+	t->drvdata.k90 = k90;
+
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t,
+			CORSAIR_USAGE_MACRO_RECORD_START, 1), 0);
+	KUNIT_EXPECT_TRUE(test, test_bit(0, &k90->recorder.active));
+	KUNIT_EXPECT_EQ(test, k90->record_led.brightness, 1);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t,
+			CORSAIR_USAGE_MACRO_RECORD_START, 0), 0);
+	KUNIT_EXPECT_TRUE(test, test_bit(0, &k90->recorder.active));
+
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t,
+			CORSAIR_USAGE_MACRO_RECORD_STOP, 1), 0);
+	KUNIT_EXPECT_FALSE(test, test_bit(0, &k90->recorder.active));
+	KUNIT_EXPECT_EQ(test, k90->record_led.brightness, 0);
+
+	/* Not in software mode, the G keys are not played by the driver */
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, 0xd0, 1), 0);
+	KUNIT_EXPECT_EQ(test, corsair_test_event(t, 0xd0, 0), 0);
+}
+
+#define CORSAIR_TEST_BENCH_EVENTS	(1 << 22)
+
+/* Time of the event callback per usage, reported without pass criterion */
+static void corsair_test_bench(struct kunit *test, const char *name,
+			       int ifnum, unsigned int first,
+			       unsigned int count)
+{
+	struct corsair_test_device *t = corsair_test_device(test, ifnum);
+	struct hid_usage hid_usage;
+	unsigned int usage;
+	u64 start, ns;
+	int ret = 0;
+	u32 i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < CORSAIR_TEST_BENCH_EVENTS; i++) {
+		usage = HID_UP_KEYBOARD | (first + i % count);
+		/* Keep the compiler from hoisting the lookup out of the loop */
+		OPTIMIZER_HIDE_VAR(usage);
+		hid_usage.hid = usage;
+		ret |= corsair_event(&t->hdev, NULL, &hid_usage, i & 1);
+	}
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	kunit_info(test, "%s: %u events in %llu ns, %llu ps per event\n",
+		   name, CORSAIR_TEST_BENCH_EVENTS, ns,
+		   div_u64(ns * 1000, CORSAIR_TEST_BENCH_EVENTS));
+}
+
+static void corsair_test_event_bench(struct kunit *test)
+{
+	/* Regular keys, on the keyboard interface and on interface 0 */
+	corsair_test_bench(test, "interface 2, regular keys",
+			   K90_RECORD_IFNUM, 0x04, 0x60);
+	corsair_test_bench(test, "interface 0, regular keys", 0, 0x04, 0x60);
+	/* Special usages that only reach the switch of the event callback */
+	corsair_test_bench(test, "interface 0, meta key", 0,
+			   CORSAIR_USAGE_META_OFF, 2);
+}
+
+static struct kunit_case corsair_test_cases[] = {
+	KUNIT_CASE(corsair_test_usage_codes),
+	KUNIT_CASE(corsair_test_gkey_usages),
+	KUNIT_CASE(corsair_test_unknown_usages),
+	KUNIT_CASE(corsair_test_profile_valid),
+	KUNIT_CASE(corsair_test_profile_truncated_header),
+	KUNIT_CASE(corsair_test_profile_bad_item),
+	KUNIT_CASE(corsair_test_profile_after_end),
+	KUNIT_CASE(corsair_test_profile_bad_length),
+	KUNIT_CASE(corsair_test_profile_bad_offset),
+	KUNIT_CASE(corsair_test_record_encode),
+	KUNIT_CASE(corsair_test_record_encode_empty),
+	KUNIT_CASE(corsair_test_record_encode_truncated),
+	KUNIT_CASE(corsair_test_parse_keycodes),
+	KUNIT_CASE(corsair_test_parse_keycodes_invalid),
+	KUNIT_CASE(corsair_test_parse_bundle),
+	KUNIT_CASE(corsair_test_parse_bundle_gkeys),
+	KUNIT_CASE(corsair_test_parse_bundle_invalid),
+	KUNIT_CASE(corsair_test_input_mapping),
+	KUNIT_CASE(corsair_test_event_other_interfaces),
+	KUNIT_CASE(corsair_test_event_state),
+	KUNIT_CASE(corsair_test_event_record),
+	KUNIT_CASE(corsair_test_event_bench),
+	{}
+};
+
+static struct kunit_suite corsair_test_suite = {
+	.name = "hid-corsair",
+	.test_cases = corsair_test_cases,
+};
+
+kunit_test_suite(corsair_test_suite);
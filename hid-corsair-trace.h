@@ -0,0 +1,81 @@
+/*
+ * Trace events for the Corsair HID driver
+ *
+ * Copyright (c) 2015 Clement Vuchener
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hid_corsair
+
+#if !defined(_HID_CORSAIR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HID_CORSAIR_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/hid.h>
+#include <linux/usb.h>
+
+/* A vendor request completed, result is the length or an error code */
+TRACE_EVENT(k90_ctrl_request,
+	TP_PROTO(struct usb_device *usbdev,
+		 const struct usb_ctrlrequest *setup, int result,
+		 s64 duration),
+	TP_ARGS(usbdev, setup, result, duration),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&usbdev->dev))
+		__field(u8, request_type)
+		__field(u8, request)
+		__field(u16, value)
+		__field(u16, index)
+		__field(u16, length)
+		__field(int, result)
+		__field(s64, duration)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&usbdev->dev));
+		__entry->request_type = setup->bRequestType;
+		__entry->request = setup->bRequest;
+		__entry->value = le16_to_cpu(setup->wValue);
+		__entry->index = le16_to_cpu(setup->wIndex);
+		__entry->length = le16_to_cpu(setup->wLength);
+		__entry->result = result;
+		__entry->duration = duration;
+	),
+	TP_printk("%s %s request=%u value=0x%04x index=0x%04x length=%u result=%d duration=%lldns",
+		  __get_str(dev),
+		  __entry->request_type & USB_DIR_IN ? "in" : "out",
+		  __entry->request, __entry->value, __entry->index,
+		  __entry->length, __entry->result, __entry->duration)
+);
+
+/* A usage of the special keys interface (G, M, MR and Light keys) */
+TRACE_EVENT(corsair_special_usage,
+	TP_PROTO(struct hid_device *hdev, unsigned int usage, int value),
+	TP_ARGS(hdev, usage, value),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&hdev->dev))
+		__field(unsigned int, usage)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&hdev->dev));
+		__entry->usage = usage;
+		__entry->value = value;
+	),
+	TP_printk("%s usage=0x%02x value=%d",
+		  __get_str(dev), __entry->usage, __entry->value)
+);
+
+#endif /* _HID_CORSAIR_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-corsair-trace
+#include <trace/define_trace.h>
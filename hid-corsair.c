@@ -18,42 +18,149 @@
 #include <linux/module.h>
 #include <linux/usb.h>
 #include <linux/leds.h>
+#include <linux/kfifo.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <asm/unaligned.h>
 
 #include "hid-ids.h"
 
+#define CREATE_TRACE_POINTS
+#include "hid-corsair-trace.h"
+
 #define CORSAIR_USE_K90_MACRO	(1<<0)
 #define CORSAIR_USE_K90_BACKLIGHT	(1<<1)
 
+#define K90_GKEY_COUNT	18
+#define K90_PROFILE_COUNT	3
+#define K90_MACRO_MAX_SIZE	128
+
+#define K90_LED_PENDING	0	/* A new value is waiting to be sent */
+
 struct k90_led {
 	struct led_classdev cdev;
+	struct hid_device *hdev;
 	int brightness;
-	struct work_struct work;
+	struct delayed_work work;
+	unsigned long flags;
+	unsigned long last_update;
+	atomic_t dropped;	/* Values overwritten before being sent */
 	bool removed;
 };
 
+struct k90_player {
+	struct hrtimer timer;
+	spinlock_t lock;
+	struct corsair_drvdata *drvdata;
+	u8 items[K90_MACRO_MAX_SIZE];
+	unsigned int length;
+	unsigned int pos;
+	unsigned int iteration;
+	int playback;
+	bool active;
+	bool delayed;	/* The current iteration had a delay */
+	bool held;	/* The G-key is still pressed */
+	bool stop;	/* The G-key was pressed again (toggle playback) */
+	DECLARE_BITMAP(pressed, KEY_CNT);	/* Key codes pressed by the macro */
+};
+
+#define K90_RECORD_RING_SIZE	256	/* Must be a power of 2 */
+#define K90_RECORD_IFNUM	2	/* The regular keys interface */
+#define K90_RECORD_MAX_EVENTS	256
+
+struct k90_record_event {
+	u64 time;	/* ns */
+	unsigned int session;
+	u8 usage;
+	u8 pressed;
+};
+
+/*
+ * Key events are pushed in the ring by the event callback of the regular
+ * keys interface only (single producer) and read from the recorded_macro
+ * attribute (single consumer), no lock is needed between them.
+ */
+struct k90_recorder {
+	DECLARE_KFIFO(ring, struct k90_record_event, K90_RECORD_RING_SIZE);
+	atomic_t session;	/* Incremented when a recording starts */
+	unsigned long active;	/* Bit 0 is set while recording */
+	atomic_t overflows;
+	/* Producer state */
+	unsigned int producer_session;
+	DECLARE_BITMAP(keys, 256);
+	/* Consumer state, protected by read_lock */
+	struct mutex read_lock;
+	unsigned int session_read;
+	unsigned int count;
+	struct k90_record_event events[K90_RECORD_MAX_EVENTS];
+};
+
+struct k90_macros;
+struct k90_bundle;
+
 struct k90_drvdata {
 	struct k90_led record_led;
+	struct k90_player players[K90_GKEY_COUNT];
+	struct mutex lock;	/* Serializes updates of macros and bundles */
+	/* Last profiles uploaded through the driver */
+	struct k90_macros __rcu *macros[K90_PROFILE_COUNT];
+	struct k90_bundle __rcu *bundles[K90_PROFILE_COUNT];
+	/* G key keymap from before a bundle replaced it, for the event path */
+	struct input_keymap_entry default_gkeys[K90_GKEY_COUNT];
+	bool gkeys_replaced;
+	bool playback_stopped;
+	struct k90_recorder recorder;
+	/* For sysfs_notify_dirent(), which unlike sysfs_notify() can be
+	 * called from atomic context */
+	struct kernfs_node *macro_mode_kn;
+	struct kernfs_node *current_profile_kn;
+	struct mutex report_lock;
+	char *profile_report;	/* Problems found in the last profile */
+	bool profile_dry_run;
+};
+
+#define K90_STATUS_SIZE	8
+
+/*
+ * Result of the last status or mode read. Callers that waited for the lock
+ * while a read was in flight share its result instead of sending another.
+ */
+struct k90_query {
+	struct mutex lock;
+	unsigned long timestamp;
+	bool valid;
+	unsigned int reads;	/* Completed reads */
+	atomic_t generation;	/* Incremented by every write */
+	char data[K90_STATUS_SIZE];
 };
 
+struct k90_ctrl;
+
 struct corsair_drvdata {
+	struct list_head node;	/* In k90_devices, for interface 0 */
+	struct usb_device *usbdev;
+	int ifnum;
 	unsigned long quirks;
 	struct k90_drvdata *k90;
 	struct k90_led *backlight;
+	struct k90_ctrl *ctrl;
+	struct workqueue_struct *wq;	/* Ordered, for control traffic */
+	struct mutex upload_lock;
+	struct k90_query status;
+	struct k90_query mode;
+	int brightness;		/* -1 when unknown */
+	int current_profile;	/* -1 when unknown */
+	int macro_mode;		/* -1 when unknown */
+	struct input_dev *input;	/* Input device of the G-keys */
+	bool keymap_attrs;
+	struct dentry *debugfs;
+	struct hid_device *hdev;
+	struct work_struct init_work;	/* Reads the initial state */
+	bool state_ready;
 };
 
-#define K90_GKEY_COUNT	18
-
-static int corsair_usage_to_gkey(unsigned int usage)
-{
-	/* G1 (0xd0) to G16 (0xdf) */
-	if (usage >= 0xd0 && usage <= 0xdf)
-		return usage - 0xd0 + 1;
-	/* G17 (0xe8) to G18 (0xe9) */
-	if (usage >= 0xe8 && usage <= 0xe9)
-		return usage - 0xe8 + 17;
-	return 0;
-}
-
 static unsigned short corsair_gkey_map[K90_GKEY_COUNT] = {
 	BTN_TRIGGER_HAPPY1,
 	BTN_TRIGGER_HAPPY2,
@@ -97,6 +204,26 @@ module_param_array_named(profilekey_codes, corsair_profile_keycodes, ushort,
 			 NULL, S_IRUGO);
 MODULE_PARM_DESC(profilekey_codes, "Key codes for the profile buttons");
 
+static unsigned int status_cache_ms = 1000;
+
+module_param(status_cache_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(status_cache_ms, "Time in milliseconds a status read is reused (0 to disable caching)");
+
+static unsigned int led_max_rate = 20;
+
+module_param(led_max_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(led_max_rate, "Maximum number of updates per second sent for each LED (0 for no limit)");
+
+static bool ctrl_highpri = true;
+
+module_param(ctrl_highpri, bool, S_IRUGO);
+MODULE_PARM_DESC(ctrl_highpri, "Run the per-device control work in a high priority workqueue");
+
+static bool sw_playback = true;
+
+module_param(sw_playback, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sw_playback, "Play the macros of the profiles uploaded through the driver when in software mode");
+
 #define CORSAIR_USAGE_SPECIAL_MIN 0xf0
 #define CORSAIR_USAGE_SPECIAL_MAX 0xff
 
@@ -119,6 +246,223 @@ MODULE_PARM_DESC(profilekey_codes, "Key codes for the profile buttons");
 #define CORSAIR_USAGE_LIGHT_BRIGHT 0xfd
 #define CORSAIR_USAGE_LIGHT_MAX 0xfd
 
+/*
+ * Usage classification, shared by the input mapping and the event
+ * callback. The table is indexed by the usage ID in the keyboard page and
+ * gives the kind of special key and its index in that kind.
+ */
+
+enum corsair_usage_class {
+	CORSAIR_CLASS_NONE = 0,	/* Regular key, passed through */
+	CORSAIR_CLASS_GKEY,	/* Index is the G-key number - 1 */
+	CORSAIR_CLASS_RECORD,	/* Index 0 starts and 1 stops recording */
+	CORSAIR_CLASS_PROFILE,	/* Index is the profile number - 1 */
+	CORSAIR_CLASS_META,	/* Index 0 is off and 1 is on */
+	CORSAIR_CLASS_LIGHT,	/* Index is the backlight brightness */
+	CORSAIR_CLASS_HIDDEN,	/* Other special usage, not mapped */
+	CORSAIR_CLASS_COUNT
+};
+
+struct corsair_usage_info {
+	u8 class;
+	u8 index;
+};
+
+#define CORSAIR_USAGE_INFO(c, i) { .class = CORSAIR_CLASS_##c, .index = (i) }
+
+static const struct corsair_usage_info corsair_usage_table[256] = {
+	[0xd0] = CORSAIR_USAGE_INFO(GKEY, 0),
+	[0xd1] = CORSAIR_USAGE_INFO(GKEY, 1),
+	[0xd2] = CORSAIR_USAGE_INFO(GKEY, 2),
+	[0xd3] = CORSAIR_USAGE_INFO(GKEY, 3),
+	[0xd4] = CORSAIR_USAGE_INFO(GKEY, 4),
+	[0xd5] = CORSAIR_USAGE_INFO(GKEY, 5),
+	[0xd6] = CORSAIR_USAGE_INFO(GKEY, 6),
+	[0xd7] = CORSAIR_USAGE_INFO(GKEY, 7),
+	[0xd8] = CORSAIR_USAGE_INFO(GKEY, 8),
+	[0xd9] = CORSAIR_USAGE_INFO(GKEY, 9),
+	[0xda] = CORSAIR_USAGE_INFO(GKEY, 10),
+	[0xdb] = CORSAIR_USAGE_INFO(GKEY, 11),
+	[0xdc] = CORSAIR_USAGE_INFO(GKEY, 12),
+	[0xdd] = CORSAIR_USAGE_INFO(GKEY, 13),
+	[0xde] = CORSAIR_USAGE_INFO(GKEY, 14),
+	[0xdf] = CORSAIR_USAGE_INFO(GKEY, 15),
+	[0xe8] = CORSAIR_USAGE_INFO(GKEY, 16),
+	[0xe9] = CORSAIR_USAGE_INFO(GKEY, 17),
+	[0xf0] = CORSAIR_USAGE_INFO(HIDDEN, 0),
+	[CORSAIR_USAGE_M1] = CORSAIR_USAGE_INFO(PROFILE, 0),
+	[CORSAIR_USAGE_M2] = CORSAIR_USAGE_INFO(PROFILE, 1),
+	[CORSAIR_USAGE_M3] = CORSAIR_USAGE_INFO(PROFILE, 2),
+	[CORSAIR_USAGE_META_OFF] = CORSAIR_USAGE_INFO(META, 0),
+	[CORSAIR_USAGE_META_ON] = CORSAIR_USAGE_INFO(META, 1),
+	[CORSAIR_USAGE_MACRO_RECORD_START] = CORSAIR_USAGE_INFO(RECORD, 0),
+	[CORSAIR_USAGE_MACRO_RECORD_STOP] = CORSAIR_USAGE_INFO(RECORD, 1),
+	[0xf8] = CORSAIR_USAGE_INFO(HIDDEN, 0),
+	[0xf9] = CORSAIR_USAGE_INFO(HIDDEN, 0),
+	[CORSAIR_USAGE_LIGHT_OFF] = CORSAIR_USAGE_INFO(LIGHT, 0),
+	[CORSAIR_USAGE_LIGHT_DIM] = CORSAIR_USAGE_INFO(LIGHT, 1),
+	[CORSAIR_USAGE_LIGHT_MEDIUM] = CORSAIR_USAGE_INFO(LIGHT, 2),
+	[CORSAIR_USAGE_LIGHT_BRIGHT] = CORSAIR_USAGE_INFO(LIGHT, 3),
+	[0xfe] = CORSAIR_USAGE_INFO(HIDDEN, 0),
+	[0xff] = CORSAIR_USAGE_INFO(HIDDEN, 0),
+};
+
+/* Key codes of the mapped classes, indexed by the usage index */
+static const unsigned short *const
+corsair_class_keycodes[CORSAIR_CLASS_COUNT] = {
+	[CORSAIR_CLASS_GKEY] = corsair_gkey_map,
+	[CORSAIR_CLASS_RECORD] = corsair_record_keycodes,
+	[CORSAIR_CLASS_PROFILE] = corsair_profile_keycodes,
+};
+
+static const struct corsair_usage_info *corsair_usage_info(unsigned int hid)
+{
+	static const struct corsair_usage_info none =
+		CORSAIR_USAGE_INFO(NONE, 0);
+
+	if ((hid & HID_USAGE_PAGE) != HID_UP_KEYBOARD ||
+	    (hid & HID_USAGE) >= ARRAY_SIZE(corsair_usage_table))
+		return &none;
+	return &corsair_usage_table[hid & HID_USAGE];
+}
+
+/*
+ * Keymap
+ *
+ * The module parameters give the initial key codes of the special keys,
+ * each keyboard can then be remapped with EVIOCSKEYCODE on its input device
+ * (the scancode is the HID usage) or through the sysfs attributes below.
+ */
+
+struct corsair_keymap_attribute {
+	struct device_attribute attr;
+	enum corsair_usage_class class;
+	unsigned int count;
+};
+
+#define to_corsair_keymap_attr(a) \
+	container_of(a, struct corsair_keymap_attribute, attr)
+
+static int corsair_class_usage(enum corsair_usage_class class,
+			       unsigned int index)
+{
+	int usage;
+
+	for (usage = 0; usage < ARRAY_SIZE(corsair_usage_table); usage++)
+		if (corsair_usage_table[usage].class == class &&
+		    corsair_usage_table[usage].index == index)
+			return usage;
+	return -1;
+}
+
+static void corsair_keymap_entry(struct input_keymap_entry *ke,
+				 unsigned int usage, unsigned int keycode)
+{
+	u32 scancode = HID_UP_KEYBOARD | usage;
+
+	memset(ke, 0, sizeof(*ke));
+	ke->len = sizeof(scancode);
+	memcpy(ke->scancode, &scancode, sizeof(scancode));
+	ke->keycode = keycode;
+}
+
+/* Parse exactly count comma-separated key codes, str is modified */
+static int corsair_parse_keycodes(char *str, u16 *keycodes,
+				  unsigned int count)
+{
+	char *token;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		token = strsep(&str, ",");
+		if (!token || kstrtou16(strim(token), 0, &keycodes[i]) ||
+		    keycodes[i] > KEY_MAX)
+			return -EINVAL;
+	}
+	if (str)
+		return -EINVAL;
+
+	return 0;
+}
+
+static ssize_t corsair_show_keymap(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	struct corsair_keymap_attribute *kattr = to_corsair_keymap_attr(attr);
+	struct input_keymap_entry ke;
+	ssize_t len = 0;
+	int i, ret;
+
+	for (i = 0; i < kattr->count; i++) {
+		corsair_keymap_entry(&ke, corsair_class_usage(kattr->class, i),
+				     KEY_RESERVED);
+		ret = input_get_keycode(drvdata->input, &ke);
+		if (ret != 0)
+			return ret;
+		len += snprintf(buf + len, PAGE_SIZE - len, "%s%u",
+				i > 0 ? "," : "", ke.keycode);
+	}
+	len += snprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static ssize_t corsair_store_keymap(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	struct corsair_keymap_attribute *kattr = to_corsair_keymap_attr(attr);
+	struct input_keymap_entry ke;
+	u16 keycodes[K90_GKEY_COUNT];
+	char *str;
+	int i, ret;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	/* Parse every key code before changing any */
+	ret = corsair_parse_keycodes(strim(str), keycodes, kattr->count);
+	kfree(str);
+	if (ret != 0)
+		return ret;
+
+	for (i = 0; i < kattr->count; i++) {
+		corsair_keymap_entry(&ke, corsair_class_usage(kattr->class, i),
+				     keycodes[i]);
+		ret = input_set_keycode(drvdata->input, &ke);
+		if (ret != 0)
+			return ret;
+	}
+
+	return count;
+}
+
+#define CORSAIR_KEYMAP_ATTR(_name, _class, _count)			\
+static struct corsair_keymap_attribute corsair_keymap_attr_##_name = {	\
+	.attr = __ATTR(_name, 0644, corsair_show_keymap,		\
+		       corsair_store_keymap),				\
+	.class = CORSAIR_CLASS_##_class,				\
+	.count = (_count),						\
+}
+
+CORSAIR_KEYMAP_ATTR(gkey_codes, GKEY, K90_GKEY_COUNT);
+CORSAIR_KEYMAP_ATTR(recordkey_codes, RECORD, 2);
+CORSAIR_KEYMAP_ATTR(profilekey_codes, PROFILE, 3);
+
+static struct attribute *corsair_keymap_attrs[] = {
+	&corsair_keymap_attr_gkey_codes.attr.attr,
+	&corsair_keymap_attr_recordkey_codes.attr.attr,
+	&corsair_keymap_attr_profilekey_codes.attr.attr,
+	NULL
+};
+
+static const struct attribute_group corsair_keymap_attr_group = {
+	.attrs = corsair_keymap_attrs,
+};
+
 /* USB control protocol */
 
 #define K90_REQUEST_BRIGHTNESS 49
@@ -126,6 +470,9 @@ MODULE_PARM_DESC(profilekey_codes, "Key codes for the profile buttons");
 #define K90_REQUEST_STATUS 4
 #define K90_REQUEST_GET_MODE 5
 #define K90_REQUEST_PROFILE 20
+#define K90_REQUEST_BINDINGS 16
+#define K90_REQUEST_MACRO_DATA 18
+#define K90_REQUEST_KEY_ROLES 22
 
 #define K90_MACRO_MODE_SW 0x0030
 #define K90_MACRO_MODE_HW 0x0001
@@ -134,260 +481,2543 @@ MODULE_PARM_DESC(profilekey_codes, "Key codes for the profile buttons");
 #define K90_MACRO_LED_OFF 0x0040
 
 /*
- * LED class devices
+ * Control transfers
+ *
+ * Every vendor request goes through a per-device queue of preallocated
+ * control URBs, each with its own DMA coherent transfer buffer that the
+ * request data is copied to or from, so callers can use buffers on the
+ * stack and nothing is allocated per request. Requests are sent one at a
+ * time in submission order (the keyboard fails requests sent too quickly
+ * after another) and completion callbacks are called from the URB
+ * completion context.
  */
 
-#define K90_BACKLIGHT_LED_SUFFIX "::backlight"
-#define K90_RECORD_LED_SUFFIX "::record"
+#define K90_CTRL_QUEUE_LEN	8
+/* Largest single transfer besides profile uploads: a firmware block */
+#define K90_CTRL_BUF_SIZE	512
+#define K90_CTRL_MAX_RETRIES	2
+#define K90_CTRL_RETRY_DELAY_MS	20
+#define K90_LATENCY_BUCKETS	16
+
+/* Requests with their own statistics, the others share the last entry */
+static const u8 k90_ctrl_stat_requests[] = {
+	K90_REQUEST_MACRO_MODE,
+	K90_REQUEST_STATUS,
+	K90_REQUEST_GET_MODE,
+	K90_REQUEST_BINDINGS,
+	K90_REQUEST_MACRO_DATA,
+	K90_REQUEST_PROFILE,
+	K90_REQUEST_KEY_ROLES,
+	K90_REQUEST_BRIGHTNESS,
+};
+
+#define K90_CTRL_STAT_COUNT	(ARRAY_SIZE(k90_ctrl_stat_requests) + 1)
+
+struct k90_ctrl_stats {
+	atomic_t issued;
+	atomic_t succeeded;
+	atomic_t failed;	/* Not counting time outs */
+	atomic_t timed_out;
+	atomic_t retried;
+	/* Bucket n counts latencies from 2^(n-1) to 2^n - 1 microseconds */
+	atomic_t latency[K90_LATENCY_BUCKETS];
+};
+
+typedef void (*k90_ctrl_callback_t)(void *context, int result,
+				    const char *data);
+
+struct k90_ctrl_req {
+	struct list_head node;
+	struct k90_ctrl *ctrl;
+	struct urb *urb;
+	struct usb_ctrlrequest *setup;
+	char *buf;		/* DMA coherent */
+	dma_addr_t buf_dma;
+	unsigned long deadline;
+	ktime_t start;	/* 0 until the URB is submitted */
+	bool timed_out;
+	bool retrying;	/* Waiting to be sent again */
+	int retries;
+	k90_ctrl_callback_t callback;
+	void *context;
+};
+
+struct k90_ctrl {
+	struct usb_device *usbdev;
+	spinlock_t lock;
+	struct list_head free;
+	struct list_head pending;
+	struct k90_ctrl_req *active;
+	struct timer_list timeout;
+	wait_queue_head_t wait;
+	bool stopped;
+	struct k90_ctrl_req reqs[K90_CTRL_QUEUE_LEN];
+	struct k90_ctrl_stats stats[K90_CTRL_STAT_COUNT];
+	atomic_t warnings;
+	int last_error;
+	u8 last_error_request;
+	unsigned long last_error_time;	/* jiffies */
+};
+
+/* Control path warnings are counted and rate limited */
+#define k90_warn(ctrl, dev, fmt, ...)					\
+	do {								\
+		atomic_inc(&(ctrl)->warnings);				\
+		dev_warn_ratelimited(dev, fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+static struct k90_ctrl_stats *k90_ctrl_stats(struct k90_ctrl *ctrl,
+					     __u8 request)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(k90_ctrl_stat_requests); i++)
+		if (k90_ctrl_stat_requests[i] == request)
+			break;
+	return &ctrl->stats[i];
+}
+
+static void k90_ctrl_account(struct k90_ctrl_req *req, int result,
+			     s64 duration)
+{
+	struct k90_ctrl *ctrl = req->ctrl;
+	struct k90_ctrl_stats *stats;
+	int bucket;
+
+	stats = k90_ctrl_stats(ctrl, req->setup->bRequest);
+	if (result >= 0) {
+		atomic_inc(&stats->succeeded);
+	} else {
+		if (result == -ETIMEDOUT)
+			atomic_inc(&stats->timed_out);
+		else
+			atomic_inc(&stats->failed);
+		WRITE_ONCE(ctrl->last_error, result);
+		WRITE_ONCE(ctrl->last_error_request, req->setup->bRequest);
+		WRITE_ONCE(ctrl->last_error_time, jiffies);
+	}
+
+	bucket = min_t(int, fls64(div_u64(duration, NSEC_PER_USEC)),
+		       K90_LATENCY_BUCKETS - 1);
+	atomic_inc(&stats->latency[bucket]);
+}
+
+static void k90_ctrl_finish(struct k90_ctrl_req *req, int result)
+{
+	struct k90_ctrl *ctrl = req->ctrl;
+	unsigned long flags;
+	s64 duration;
+
+	/*
+	 * Requests cancelled before being sent are not accounted. The
+	 * duration is needed by the statistics whether or not the trace
+	 * event is enabled.
+	 */
+	if (req->start) {
+		duration = ktime_to_ns(ktime_sub(ktime_get(), req->start));
+		k90_ctrl_account(req, result, duration);
+		trace_k90_ctrl_request(ctrl->usbdev, req->setup, result,
+				       duration);
+	}
+
+	req->callback(req->context, result, req->urb->transfer_buffer);
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	if (ctrl->active == req)
+		ctrl->active = NULL;
+	list_add(&req->node, &ctrl->free);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+	wake_up_all(&ctrl->wait);
+}
+
+static void k90_ctrl_kick(struct k90_ctrl *ctrl)
+{
+	int ret;
+	struct k90_ctrl_req *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	while (!ctrl->active && !ctrl->stopped &&
+	       !list_empty(&ctrl->pending)) {
+		req = list_first_entry(&ctrl->pending, struct k90_ctrl_req,
+				       node);
+		list_del(&req->node);
+		ctrl->active = req;
+		req->timed_out = false;
+		req->retrying = false;
+		req->retries = 0;
+		req->deadline = jiffies +
+				msecs_to_jiffies(USB_CTRL_SET_TIMEOUT);
+		mod_timer(&ctrl->timeout, req->deadline);
+		req->start = ktime_get();
+		atomic_inc(&k90_ctrl_stats(ctrl, req->setup->bRequest)->issued);
+		ret = usb_submit_urb(req->urb, GFP_ATOMIC);
+		if (ret == 0)
+			break;
+
+		del_timer(&ctrl->timeout);
+		spin_unlock_irqrestore(&ctrl->lock, flags);
+		k90_ctrl_finish(req, ret);
+		spin_lock_irqsave(&ctrl->lock, flags);
+	}
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+}
+
+/*
+ * Send again a request that failed with a protocol error, the keyboard
+ * sometimes stalls a request that it accepts when sent again. It also
+ * stalls requests sent too soon after the previous one, so the request
+ * stays active and is resubmitted by the timer after a delay.
+ */
+static bool k90_ctrl_retry(struct k90_ctrl_req *req, int result)
+{
+	struct k90_ctrl *ctrl = req->ctrl;
+	unsigned long flags;
+	bool retried = false;
+
+	if (result != -EPIPE && result != -EPROTO)
+		return false;
+	if (req->retries >= K90_CTRL_MAX_RETRIES)
+		return false;
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	if (!ctrl->stopped) {
+		req->retries++;
+		req->retrying = true;
+		mod_timer(&ctrl->timeout,
+			  jiffies + msecs_to_jiffies(K90_CTRL_RETRY_DELAY_MS));
+		retried = true;
+	}
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+
+	if (retried)
+		atomic_inc(&k90_ctrl_stats(ctrl,
+					   req->setup->bRequest)->retried);
+	return retried;
+}
+
+static void k90_ctrl_complete(struct urb *urb)
+{
+	struct k90_ctrl_req *req = urb->context;
+	struct k90_ctrl *ctrl = req->ctrl;
+	int result;
+
+	del_timer(&ctrl->timeout);
+
+	if (req->timed_out && urb->status == -ECONNRESET)
+		result = -ETIMEDOUT;
+	else if (urb->status)
+		result = urb->status;
+	else
+		result = urb->actual_length;
+
+	if (k90_ctrl_retry(req, result))
+		return;
+
+	k90_ctrl_finish(req, result);
+	k90_ctrl_kick(ctrl);
+}
+
+/* Times out the active request, or sends it again after a retry delay */
+static void k90_ctrl_timeout(struct timer_list *t)
+{
+	struct k90_ctrl *ctrl = from_timer(ctrl, t, timeout);
+	struct k90_ctrl_req *req, *failed = NULL;
+	struct urb *urb = NULL;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	req = ctrl->active;
+	if (req && req->retrying) {
+		req->retrying = false;
+		if (ctrl->stopped) {
+			ret = -ESHUTDOWN;
+		} else {
+			req->deadline = jiffies +
+					msecs_to_jiffies(USB_CTRL_SET_TIMEOUT);
+			mod_timer(&ctrl->timeout, req->deadline);
+			ret = usb_submit_urb(req->urb, GFP_ATOMIC);
+			if (ret != 0)
+				del_timer(&ctrl->timeout);
+		}
+		if (ret != 0)
+			failed = req;
+	} else if (req && time_after_eq(jiffies, req->deadline)) {
+		req->timed_out = true;
+		urb = usb_get_urb(req->urb);
+	}
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+
+	if (failed) {
+		k90_ctrl_finish(failed, ret);
+		k90_ctrl_kick(ctrl);
+	}
+	if (urb) {
+		usb_unlink_urb(urb);
+		usb_put_urb(urb);
+	}
+}
+
+static int __k90_ctrl_submit(struct k90_ctrl *ctrl, __u8 request, __u8 dir,
+			     __u16 value, __u16 index, const void *data,
+			     void *dma_buf, __u16 size,
+			     k90_ctrl_callback_t callback, void *context)
+{
+	struct k90_ctrl_req *req;
+	unsigned int pipe;
+	unsigned long flags;
+	void *buf;
+
+	if (!dma_buf && size > K90_CTRL_BUF_SIZE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	if (ctrl->stopped) {
+		spin_unlock_irqrestore(&ctrl->lock, flags);
+		return -ESHUTDOWN;
+	}
+	if (list_empty(&ctrl->free)) {
+		spin_unlock_irqrestore(&ctrl->lock, flags);
+		return -EBUSY;
+	}
+	req = list_first_entry(&ctrl->free, struct k90_ctrl_req, node);
+	list_del(&req->node);
+
+	req->setup->bRequestType = dir | USB_TYPE_VENDOR | USB_RECIP_DEVICE;
+	req->setup->bRequest = request;
+	req->setup->wValue = cpu_to_le16(value);
+	req->setup->wIndex = cpu_to_le16(index);
+	req->setup->wLength = cpu_to_le16(size);
+	if (dma_buf) {
+		buf = dma_buf;
+	} else {
+		buf = req->buf;
+		if (dir == USB_DIR_OUT && size > 0)
+			memcpy(buf, data, size);
+	}
+	if (dir == USB_DIR_IN)
+		pipe = usb_rcvctrlpipe(ctrl->usbdev, 0);
+	else
+		pipe = usb_sndctrlpipe(ctrl->usbdev, 0);
+	usb_fill_control_urb(req->urb, ctrl->usbdev, pipe,
+			     (unsigned char *)req->setup, buf, size,
+			     k90_ctrl_complete, req);
+	if (dma_buf) {
+		req->urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+	} else {
+		req->urb->transfer_dma = req->buf_dma;
+		req->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	req->callback = callback;
+	req->context = context;
+	req->start = 0;
+
+	list_add_tail(&req->node, &ctrl->pending);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+
+	k90_ctrl_kick(ctrl);
+	return 0;
+}
+
+/*
+ * Queue a vendor request. Data for OUT requests is copied, data of IN
+ * requests is passed to the callback. May be called from atomic context.
+ */
+static int k90_ctrl_submit(struct k90_ctrl *ctrl, __u8 request, __u8 dir,
+			   __u16 value, __u16 index, const void *data,
+			   __u16 size, k90_ctrl_callback_t callback,
+			   void *context)
+{
+	return __k90_ctrl_submit(ctrl, request, dir, value, index, data, NULL,
+				 size, callback, context);
+}
+
+/*
+ * Same as k90_ctrl_submit() but waits for a free slot if the queue is full.
+ * Must not be called from atomic context.
+ */
+static int k90_ctrl_submit_wait(struct k90_ctrl *ctrl, __u8 request, __u8 dir,
+				__u16 value, __u16 index, const void *data,
+				__u16 size, k90_ctrl_callback_t callback,
+				void *context)
+{
+	int ret, err;
+
+	err = wait_event_killable(ctrl->wait,
+				  (ret = k90_ctrl_submit(ctrl, request, dir,
+							 value, index, data,
+							 size, callback,
+							 context)) != -EBUSY);
+	if (err)
+		return err;
+	return ret;
+}
+
+/*
+ * Same as k90_ctrl_submit() but the transfer uses buf directly. It must be
+ * DMA-able and stay valid until the callback is called.
+ */
+static int k90_ctrl_submit_dma(struct k90_ctrl *ctrl, __u8 request,
+			       __u8 dir, __u16 value, __u16 index, void *buf,
+			       __u16 size, k90_ctrl_callback_t callback,
+			       void *context)
+{
+	return __k90_ctrl_submit(ctrl, request, dir, value, index, NULL, buf,
+				 size, callback, context);
+}
+
+struct k90_ctrl_wait {
+	struct completion done;
+	int result;
+	void *data;
+	__u16 size;
+};
+
+static void k90_ctrl_wait_complete(void *context, int result,
+				   const char *data)
+{
+	struct k90_ctrl_wait *wait = context;
+
+	if (result > 0 && wait->data)
+		memcpy(wait->data, data, min_t(int, result, wait->size));
+	wait->result = result;
+	complete(&wait->done);
+}
+
+/*
+ * Synchronous version of k90_ctrl_submit(), returns the number of bytes
+ * transferred or a negative error code.
+ */
+static int k90_ctrl_msg(struct k90_ctrl *ctrl, __u8 request, __u8 dir,
+			__u16 value, __u16 index, void *data, __u16 size)
+{
+	int ret;
+	struct k90_ctrl_wait wait;
+
+	init_completion(&wait.done);
+	wait.data = dir == USB_DIR_IN ? data : NULL;
+	wait.size = size;
+
+	ret = k90_ctrl_submit_wait(ctrl, request, dir, value, index, data,
+				   size, k90_ctrl_wait_complete, &wait);
+	if (ret < 0)
+		return ret;
+
+	wait_for_completion(&wait.done);
+	return wait.result;
+}
+
+static bool k90_ctrl_idle(struct k90_ctrl *ctrl)
+{
+	bool idle;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	idle = !ctrl->active && list_empty(&ctrl->pending);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+
+	return idle;
+}
+
+/* Wait for every queued request to complete */
+static void k90_ctrl_flush(struct k90_ctrl *ctrl)
+{
+	wait_event(ctrl->wait, k90_ctrl_idle(ctrl));
+}
+
+static void k90_ctrl_free_reqs(struct k90_ctrl *ctrl)
+{
+	int i;
+
+	for (i = 0; i < K90_CTRL_QUEUE_LEN; i++) {
+		usb_free_urb(ctrl->reqs[i].urb);
+		kfree(ctrl->reqs[i].setup);
+		usb_free_coherent(ctrl->usbdev, K90_CTRL_BUF_SIZE,
+				  ctrl->reqs[i].buf, ctrl->reqs[i].buf_dma);
+	}
+}
+
+static int k90_ctrl_init(struct k90_ctrl *ctrl, struct usb_device *usbdev)
+{
+	int i;
+	struct k90_ctrl_req *req;
+
+	ctrl->usbdev = usbdev;
+	spin_lock_init(&ctrl->lock);
+	INIT_LIST_HEAD(&ctrl->free);
+	INIT_LIST_HEAD(&ctrl->pending);
+	ctrl->active = NULL;
+	timer_setup(&ctrl->timeout, k90_ctrl_timeout, 0);
+	init_waitqueue_head(&ctrl->wait);
+	ctrl->stopped = false;
+
+	for (i = 0; i < K90_CTRL_QUEUE_LEN; i++) {
+		req = &ctrl->reqs[i];
+		req->ctrl = ctrl;
+		req->urb = usb_alloc_urb(0, GFP_KERNEL);
+		req->setup = kmalloc(sizeof(struct usb_ctrlrequest),
+				     GFP_KERNEL);
+		req->buf = usb_alloc_coherent(usbdev, K90_CTRL_BUF_SIZE,
+					      GFP_KERNEL, &req->buf_dma);
+		if (!req->urb || !req->setup || !req->buf) {
+			k90_ctrl_free_reqs(ctrl);
+			return -ENOMEM;
+		}
+		list_add_tail(&req->node, &ctrl->free);
+	}
+
+	return 0;
+}
+
+static void k90_ctrl_cleanup(struct k90_ctrl *ctrl)
+{
+	int i;
+	struct k90_ctrl_req *req, *tmp;
+	unsigned long flags;
+	LIST_HEAD(cancelled);
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	ctrl->stopped = true;
+	list_splice_init(&ctrl->pending, &cancelled);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+
+	list_for_each_entry_safe(req, tmp, &cancelled, node) {
+		list_del(&req->node);
+		k90_ctrl_finish(req, -ESHUTDOWN);
+	}
+	for (i = 0; i < K90_CTRL_QUEUE_LEN; i++)
+		usb_kill_urb(ctrl->reqs[i].urb);
+	del_timer_sync(&ctrl->timeout);
+
+	/* A request waiting to be sent again has no URB to kill */
+	spin_lock_irqsave(&ctrl->lock, flags);
+	req = ctrl->active;
+	if (req && req->retrying)
+		req->retrying = false;
+	else
+		req = NULL;
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+	if (req)
+		k90_ctrl_finish(req, -ESHUTDOWN);
+
+	k90_ctrl_free_reqs(ctrl);
+}
+
+/*
+ * Statistics in debugfs
+ */
+
+static struct dentry *corsair_debugfs_root;
+
+static int k90_ctrl_stats_show(struct seq_file *s, void *unused)
+{
+	struct k90_ctrl *ctrl = s->private;
+	struct k90_ctrl_stats *stats;
+	int i, last_error;
+
+	seq_printf(s, "%-8s %8s %8s %8s %8s %8s\n", "request", "issued",
+		   "ok", "failed", "timeout", "retried");
+	for (i = 0; i < K90_CTRL_STAT_COUNT; i++) {
+		stats = &ctrl->stats[i];
+		if (i < ARRAY_SIZE(k90_ctrl_stat_requests))
+			seq_printf(s, "%-8u", k90_ctrl_stat_requests[i]);
+		else
+			seq_printf(s, "%-8s", "other");
+		seq_printf(s, " %8d %8d %8d %8d %8d\n",
+			   atomic_read(&stats->issued),
+			   atomic_read(&stats->succeeded),
+			   atomic_read(&stats->failed),
+			   atomic_read(&stats->timed_out),
+			   atomic_read(&stats->retried));
+	}
+
+	seq_printf(s, "warnings: %d\n", atomic_read(&ctrl->warnings));
+	last_error = READ_ONCE(ctrl->last_error);
+	if (last_error)
+		seq_printf(s, "last error: %d (request %u, %u ms ago)\n",
+			   last_error, READ_ONCE(ctrl->last_error_request),
+			   jiffies_to_msecs(jiffies -
+					    READ_ONCE(ctrl->last_error_time)));
+	else
+		seq_puts(s, "last error: none\n");
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(k90_ctrl_stats);
+
+static int k90_ctrl_latency_show(struct seq_file *s, void *unused)
+{
+	struct k90_ctrl *ctrl = s->private;
+	int i, j;
+
+	/* One column per bucket, labeled with its lower bound */
+	seq_printf(s, "%-8s %6s", "us", "0");
+	for (j = 1; j < K90_LATENCY_BUCKETS; j++)
+		seq_printf(s, " %6u", 1u << (j - 1));
+	seq_putc(s, '\n');
+
+	for (i = 0; i < K90_CTRL_STAT_COUNT; i++) {
+		if (i < ARRAY_SIZE(k90_ctrl_stat_requests))
+			seq_printf(s, "%-8u", k90_ctrl_stat_requests[i]);
+		else
+			seq_printf(s, "%-8s", "other");
+		for (j = 0; j < K90_LATENCY_BUCKETS; j++)
+			seq_printf(s, " %6d",
+				   atomic_read(&ctrl->stats[i].latency[j]));
+		seq_putc(s, '\n');
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(k90_ctrl_latency);
+
+/*
+ * Usages seen by the event callback, counted per CPU for all keyboards.
+ * Counting is off by default, the static key then leaves only a no-op in
+ * the event callback.
+ */
+struct corsair_event_stats {
+	u64 handled;	/* Special keys of interface 0 */
+	u64 filtered;	/* Regular keys of interface 0 */
+	u64 other;	/* Usages of the other interfaces */
+};
+
+static DEFINE_PER_CPU(struct corsair_event_stats, corsair_event_stats);
+static DEFINE_STATIC_KEY_FALSE(corsair_event_stats_enabled);
+
+#define corsair_count_event(field)					\
+	do {								\
+		if (static_branch_unlikely(&corsair_event_stats_enabled)) \
+			this_cpu_inc(corsair_event_stats.field);	\
+	} while (0)
+
+static int corsair_event_stats_set(const char *val,
+				   const struct kernel_param *kp)
+{
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(val, &enable);
+	if (ret != 0)
+		return ret;
+
+	if (enable)
+		static_branch_enable(&corsair_event_stats_enabled);
+	else
+		static_branch_disable(&corsair_event_stats_enabled);
+	return 0;
+}
+
+static int corsair_event_stats_get(char *buf, const struct kernel_param *kp)
+{
+	return snprintf(buf, PAGE_SIZE, "%c\n",
+			static_key_enabled(&corsair_event_stats_enabled) ?
+			'Y' : 'N');
+}
+
+static const struct kernel_param_ops corsair_event_stats_ops = {
+	.set = corsair_event_stats_set,
+	.get = corsair_event_stats_get,
+};
+
+module_param_cb(event_stats, &corsair_event_stats_ops, NULL,
+		S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(event_stats, "Count the usages seen by the event callback in the events debugfs file");
+
+static int corsair_events_show(struct seq_file *s, void *unused)
+{
+	struct corsair_event_stats *stats;
+	u64 handled = 0, filtered = 0, other = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(&corsair_event_stats, cpu);
+		handled += READ_ONCE(stats->handled);
+		filtered += READ_ONCE(stats->filtered);
+		other += READ_ONCE(stats->other);
+	}
+	seq_printf(s, "handled: %llu\nfiltered: %llu\nother: %llu\n",
+		   handled, filtered, other);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(corsair_events);
+
+/* Errors are ignored, the statistics are only for debugging */
+static void k90_init_debugfs(struct hid_device *dev)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+
+	drvdata->debugfs = debugfs_create_dir(dev_name(&dev->dev),
+					      corsair_debugfs_root);
+	debugfs_create_file("ctrl_stats", 0444, drvdata->debugfs,
+			    drvdata->ctrl, &k90_ctrl_stats_fops);
+	debugfs_create_file("ctrl_latency", 0444, drvdata->debugfs,
+			    drvdata->ctrl, &k90_ctrl_latency_fops);
+}
+
+/*
+ * Device status
+ */
+
+static int k90_query(struct corsair_drvdata *drvdata, struct k90_query *query,
+		     int request, size_t size, unsigned int cache_ms,
+		     char *data)
+{
+	int ret = 0;
+	unsigned int reads = READ_ONCE(query->reads);
+	unsigned int generation;
+
+	mutex_lock(&query->lock);
+	if (READ_ONCE(query->valid) &&
+	    (query->reads != reads ||
+	     time_before(jiffies, query->timestamp +
+			 msecs_to_jiffies(cache_ms))))
+		goto copy;
+
+	generation = atomic_read(&query->generation);
+	ret = k90_ctrl_msg(drvdata->ctrl, request, USB_DIR_IN, 0, 0,
+			   query->data, size);
+	if (ret < 0) {
+		WRITE_ONCE(query->valid, false);
+		goto out;
+	}
+	query->timestamp = jiffies;
+	WRITE_ONCE(query->reads, query->reads + 1);
+	/* Do not keep the result if a write completed meanwhile */
+	WRITE_ONCE(query->valid,
+		   atomic_read(&query->generation) == generation);
+	ret = 0;
+copy:
+	memcpy(data, query->data, size);
+out:
+	mutex_unlock(&query->lock);
+	return ret;
+}
+
+/* May be called from atomic context */
+static void k90_invalidate_query(struct k90_query *query)
+{
+	atomic_inc(&query->generation);
+	WRITE_ONCE(query->valid, false);
+}
+
+static int k90_get_status(struct hid_device *dev, char *status)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+
+	return k90_query(drvdata, &drvdata->status, K90_REQUEST_STATUS,
+			 K90_STATUS_SIZE, status_cache_ms, status);
+}
+
+/* May be called from atomic context */
+static void k90_invalidate_status(struct corsair_drvdata *drvdata)
+{
+	k90_invalidate_query(&drvdata->status);
+}
+
+/*
+ * The status may come from the cache, the values tracked from the events
+ * and the stores are newer: a value read only replaces an unknown one.
+ * Returns the value to show.
+ */
+static int k90_track_value(int *tracked, int value)
+{
+	int old = cmpxchg(tracked, -1, value);
+
+	return old >= 0 ? old : value;
+}
+
+/* The mode is not cached, concurrent reads still share one transfer */
+static int k90_get_mode(struct hid_device *dev, char *mode)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+
+	return k90_query(drvdata, &drvdata->mode, K90_REQUEST_GET_MODE,
+			 2, 0, mode);
+}
+
+/*
+ * LED class devices
+ */
+
+#define K90_BACKLIGHT_LED_SUFFIX "::backlight"
+#define K90_RECORD_LED_SUFFIX "::record"
+
+static enum led_brightness k90_backlight_get(struct led_classdev *led_cdev)
+{
+	int ret;
+	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
+	struct device *dev = led->cdev.dev->parent;
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	int brightness;
+	char data[K90_STATUS_SIZE];
+
+	brightness = READ_ONCE(drvdata->brightness);
+	if (brightness >= 0)
+		return brightness;
+	/* Called by the LED registration, before the initial state is read */
+	if (!READ_ONCE(drvdata->state_ready))
+		return led_cdev->brightness;
+
+	ret = k90_get_status(to_hid_device(dev), data);
+	if (ret < 0) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Failed to get K90 initial state (error %d).\n",
+			 ret);
+		return -EIO;
+	}
+	brightness = data[4];
+	if (brightness < 0 || brightness > 3) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Read invalid backlight brightness: %02hhx.\n",
+			 data[4]);
+		return -EIO;
+	}
+	return k90_track_value(&drvdata->brightness, brightness);
+}
+
+static enum led_brightness k90_record_led_get(struct led_classdev *led_cdev)
+{
+	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
+
+	return led->brightness;
+}
+
+static void k90_brightness_set(struct led_classdev *led_cdev,
+			       enum led_brightness brightness)
+{
+	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
+	struct corsair_drvdata *drvdata = hid_get_drvdata(led->hdev);
+	unsigned int rate = READ_ONCE(led_max_rate);
+	unsigned long next, delay = 0;
+
+	WRITE_ONCE(led->brightness, brightness);
+
+	/* Only the newest value is sent, older pending ones are dropped */
+	if (test_and_set_bit(K90_LED_PENDING, &led->flags)) {
+		atomic_inc(&led->dropped);
+		return;
+	}
+
+	if (rate > 0) {
+		next = READ_ONCE(led->last_update) + DIV_ROUND_UP(HZ, rate);
+		if (time_before(jiffies, next))
+			delay = next - jiffies;
+	}
+	queue_delayed_work(drvdata->wq, &led->work, delay);
+}
+
+static ssize_t k90_show_dropped_updates(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct led_classdev *led_cdev = dev_get_drvdata(dev);
+	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&led->dropped));
+}
+
+static DEVICE_ATTR(dropped_updates, 0444, k90_show_dropped_updates, NULL);
+
+static struct attribute *k90_led_attrs[] = {
+	&dev_attr_dropped_updates.attr,
+	NULL
+};
+
+static const struct attribute_group k90_led_attr_group = {
+	.attrs = k90_led_attrs,
+};
+
+static const struct attribute_group *k90_led_groups[] = {
+	&k90_led_attr_group,
+	NULL
+};
+
+/* Take the pending value, called by the LED work before sending it */
+static int k90_led_take_value(struct k90_led *led)
+{
+	clear_bit(K90_LED_PENDING, &led->flags);
+	smp_mb__after_atomic();
+	WRITE_ONCE(led->last_update, jiffies);
+
+	return READ_ONCE(led->brightness);
+}
+
+static void k90_backlight_complete(void *context, int result,
+				   const char *data)
+{
+	struct k90_led *led = context;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(led->hdev);
+
+	k90_invalidate_status(drvdata);
+	if (result < 0) {
+		WRITE_ONCE(drvdata->brightness, -1);
+		k90_warn(drvdata->ctrl, &led->hdev->dev,
+			 "Failed to set backlight brightness (error: %d).\n",
+			 result);
+	}
+}
+
+static void k90_backlight_work(struct work_struct *work)
+{
+	int ret;
+	struct k90_led *led = container_of(to_delayed_work(work),
+					   struct k90_led, work);
+	struct corsair_drvdata *drvdata = hid_get_drvdata(led->hdev);
+	int brightness;
+
+	if (led->removed)
+		return;
+
+	brightness = k90_led_take_value(led);
+	WRITE_ONCE(drvdata->brightness, brightness);
+	/* Dropping the value would leave the LED out of sync */
+	ret = k90_ctrl_submit_wait(drvdata->ctrl, K90_REQUEST_BRIGHTNESS,
+				   USB_DIR_OUT, brightness, 0, NULL, 0,
+				   k90_backlight_complete, led);
+	if (ret != 0) {
+		WRITE_ONCE(drvdata->brightness, -1);
+		k90_warn(drvdata->ctrl, &led->hdev->dev,
+			 "Failed to set backlight brightness (error: %d).\n",
+			 ret);
+	}
+}
+
+/*
+ * The keyboard only blinks the record LED at its own rate (about once per
+ * second), "on" is already this blinking. Accepting any other delays keeps
+ * triggers such as timer from toggling the LED with one transfer each.
+ *
+ * A null delay_on switches the LED off. A null delay_off asks for a solid
+ * LED, which the keyboard cannot show: the LED is switched on and blinks,
+ * as for the other delays. The delays written back are the ones used.
+ */
+#define K90_RECORD_LED_BLINK_MS	500
+
+static int k90_record_led_blink_set(struct led_classdev *led_cdev,
+				    unsigned long *delay_on,
+				    unsigned long *delay_off)
+{
+	if (*delay_on == 0 && *delay_off != 0) {
+		k90_brightness_set(led_cdev, 0);
+		return 0;
+	}
+
+	*delay_on = K90_RECORD_LED_BLINK_MS;
+	*delay_off = K90_RECORD_LED_BLINK_MS;
+	k90_brightness_set(led_cdev, 1);
+
+	return 0;
+}
+
+static void k90_record_led_complete(void *context, int result,
+				    const char *data)
+{
+	struct k90_led *led = context;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(led->hdev);
+
+	if (result < 0)
+		k90_warn(drvdata->ctrl, &led->hdev->dev,
+			 "Failed to set record LED state (error: %d).\n",
+			 result);
+}
+
+static void k90_record_led_work(struct work_struct *work)
+{
+	int ret;
+	struct k90_led *led = container_of(to_delayed_work(work),
+					   struct k90_led, work);
+	struct corsair_drvdata *drvdata = hid_get_drvdata(led->hdev);
+	int value;
+
+	if (led->removed)
+		return;
+
+	if (k90_led_take_value(led) > 0)
+		value = K90_MACRO_LED_ON;
+	else
+		value = K90_MACRO_LED_OFF;
+
+	ret = k90_ctrl_submit_wait(drvdata->ctrl, K90_REQUEST_MACRO_MODE,
+				   USB_DIR_OUT, value, 0, NULL, 0,
+				   k90_record_led_complete, led);
+	if (ret != 0)
+		k90_warn(drvdata->ctrl, &led->hdev->dev,
+			 "Failed to set record LED state (error: %d).\n",
+			 ret);
+}
+
+/*
+ * Keyboard attributes
+ */
+
+static ssize_t k90_show_macro_mode(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	const char *macro_mode;
+	char data[2];
+
+	ret = k90_get_mode(to_hid_device(dev), data);
+	if (ret < 0) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Failed to get K90 initial mode (error %d).\n",
+			 ret);
+		return -EIO;
+	}
+
+	switch (data[0]) {
+	case K90_MACRO_MODE_HW:
+		macro_mode = "HW";
+		break;
+
+	case K90_MACRO_MODE_SW:
+		macro_mode = "SW";
+		break;
+	default:
+		k90_warn(drvdata->ctrl, dev, "K90 in unknown mode: %02hhx.\n",
+			 data[0]);
+		return -EIO;
+	}
+	WRITE_ONCE(drvdata->macro_mode, data[0]);
+
+	return snprintf(buf, PAGE_SIZE, "%s\n", macro_mode);
+}
+
+/* May be called from atomic context */
+static void k90_notify_macro_mode(struct corsair_drvdata *drvdata)
+{
+	struct k90_drvdata *k90 = READ_ONCE(drvdata->k90);
+
+	if (k90)
+		sysfs_notify_dirent(k90->macro_mode_kn);
+}
+
+/* May be called from atomic context */
+static void k90_notify_current_profile(struct corsair_drvdata *drvdata)
+{
+	struct k90_drvdata *k90 = READ_ONCE(drvdata->k90);
+
+	if (k90)
+		sysfs_notify_dirent(k90->current_profile_kn);
+}
+
+static void k90_macro_mode_complete(void *context, int result,
+				    const char *data)
+{
+	struct hid_device *hdev = context;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	k90_invalidate_query(&drvdata->mode);
+	if (result < 0) {
+		WRITE_ONCE(drvdata->macro_mode, -1);
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to set macro mode (error %d).\n",
+			 result);
+		return;
+	}
+	k90_notify_macro_mode(drvdata);
+}
+
+/*
+ * Waits for a free slot in the request queue if may_sleep is set, otherwise
+ * fails with -EBUSY when it is full.
+ */
+static int k90_set_macro_mode(struct hid_device *hdev, __u16 value,
+			      bool may_sleep)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	WRITE_ONCE(drvdata->macro_mode, value);
+	if (may_sleep)
+		ret = k90_ctrl_submit_wait(drvdata->ctrl,
+					   K90_REQUEST_MACRO_MODE,
+					   USB_DIR_OUT, value, 0, NULL, 0,
+					   k90_macro_mode_complete, hdev);
+	else
+		ret = k90_ctrl_submit(drvdata->ctrl, K90_REQUEST_MACRO_MODE,
+				      USB_DIR_OUT, value, 0, NULL, 0,
+				      k90_macro_mode_complete, hdev);
+	if (ret != 0)
+		WRITE_ONCE(drvdata->macro_mode, -1);
+
+	return ret;
+}
+
+static ssize_t k90_store_macro_mode(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	__u16 value;
+
+	if (strncmp(buf, "SW", 2) == 0)
+		value = K90_MACRO_MODE_SW;
+	else if (strncmp(buf, "HW", 2) == 0)
+		value = K90_MACRO_MODE_HW;
+	else
+		return -EINVAL;
+
+	ret = k90_set_macro_mode(to_hid_device(dev), value, true);
+	if (ret != 0) {
+		k90_warn(drvdata->ctrl, dev, "Failed to set macro mode.\n");
+		return ret;
+	}
+
+	return count;
+}
+
+static ssize_t k90_show_current_profile(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	int current_profile;
+	char data[K90_STATUS_SIZE];
+
+	current_profile = READ_ONCE(drvdata->current_profile);
+	if (current_profile >= 0)
+		return snprintf(buf, PAGE_SIZE, "%d\n", current_profile);
+
+	ret = k90_get_status(to_hid_device(dev), data);
+	if (ret < 0) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Failed to get K90 initial state (error %d).\n",
+			 ret);
+		return -EIO;
+	}
+	current_profile = data[7];
+	if (current_profile < 1 || current_profile > 3) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Read invalid current profile: %02hhx.\n",
+			 data[7]);
+		return -EIO;
+	}
+	current_profile = k90_track_value(&drvdata->current_profile,
+					  current_profile);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", current_profile);
+}
+
+static void k90_current_profile_complete(void *context, int result,
+					 const char *data)
+{
+	struct hid_device *hdev = context;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	k90_invalidate_status(drvdata);
+	if (result < 0) {
+		WRITE_ONCE(drvdata->current_profile, -1);
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to change current profile (error %d).\n",
+			 result);
+		return;
+	}
+	k90_notify_current_profile(drvdata);
+}
+
+static void k90_release_players(struct k90_drvdata *k90);
+
+static int k90_set_current_profile(struct hid_device *hdev, int profile)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	if (xchg(&drvdata->current_profile, profile) != profile &&
+	    drvdata->k90)
+		k90_release_players(drvdata->k90);
+	ret = k90_ctrl_submit_wait(drvdata->ctrl, K90_REQUEST_PROFILE,
+				   USB_DIR_OUT, profile, 0, NULL, 0,
+				   k90_current_profile_complete, hdev);
+	if (ret != 0) {
+		WRITE_ONCE(drvdata->current_profile, -1);
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to change current profile (error %d).\n",
+			 ret);
+	}
+
+	return ret;
+}
+
+static ssize_t k90_store_current_profile(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	int ret;
+	int profile;
+
+	if (kstrtoint(buf, 10, &profile))
+		return -EINVAL;
+	if (profile < 1 || profile > 3)
+		return -EINVAL;
+
+	ret = k90_set_current_profile(to_hid_device(dev), profile);
+	if (ret != 0)
+		return ret;
+
+	return count;
+}
+
+/*
+ * The whole state at once: the profile and brightness from one status
+ * read and the macro mode from one mode read. Written values are only
+ * sent when they differ from the last known state.
+ */
+
+static ssize_t k90_show_state(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	int brightness, current_profile, macro_mode;
+	char status[K90_STATUS_SIZE];
+	char mode[2];
+
+	ret = k90_get_status(to_hid_device(dev), status);
+	if (ret < 0) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Failed to get K90 state (error %d).\n", ret);
+		return -EIO;
+	}
+	brightness = status[4];
+	current_profile = status[7];
+	if (brightness < 0 || brightness > 3 ||
+	    current_profile < 1 || current_profile > 3) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Read invalid state: %02hhx %02hhx.\n",
+			 status[4], status[7]);
+		return -EIO;
+	}
+
+	ret = k90_get_mode(to_hid_device(dev), mode);
+	if (ret < 0) {
+		k90_warn(drvdata->ctrl, dev,
+			 "Failed to get K90 mode (error %d).\n", ret);
+		return -EIO;
+	}
+	if (mode[0] != K90_MACRO_MODE_HW && mode[0] != K90_MACRO_MODE_SW) {
+		k90_warn(drvdata->ctrl, dev, "K90 in unknown mode: %02hhx.\n",
+			 mode[0]);
+		return -EIO;
+	}
+
+	brightness = k90_track_value(&drvdata->brightness, brightness);
+	current_profile = k90_track_value(&drvdata->current_profile,
+					  current_profile);
+	macro_mode = k90_track_value(&drvdata->macro_mode, mode[0]);
+
+	return snprintf(buf, PAGE_SIZE,
+			"current_profile=%d\nbrightness=%d\nmacro_mode=%s\n",
+			current_profile, brightness,
+			macro_mode == K90_MACRO_MODE_SW ? "SW" : "HW");
+}
+
+static ssize_t k90_store_state(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	int ret;
+	struct hid_device *hdev = to_hid_device(dev);
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	struct k90_led *backlight = drvdata->backlight;
+	int current_profile = -1, brightness = -1, macro_mode = -1;
+	char *str, *cur, *token, *value;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	/* Check every field before sending anything */
+	ret = -EINVAL;
+	cur = str;
+	while ((token = strsep(&cur, " \t\n")) != NULL) {
+		if (*token == '\0')
+			continue;
+		value = strchr(token, '=');
+		if (!value)
+			goto out;
+		*value++ = '\0';
+
+		if (strcmp(token, "current_profile") == 0) {
+			if (kstrtoint(value, 10, &current_profile) ||
+			    current_profile < 1 || current_profile > 3)
+				goto out;
+		} else if (strcmp(token, "brightness") == 0) {
+			if (kstrtoint(value, 10, &brightness) ||
+			    brightness < 0 || brightness > 3 || !backlight)
+				goto out;
+		} else if (strcmp(token, "macro_mode") == 0) {
+			if (strcmp(value, "SW") == 0)
+				macro_mode = K90_MACRO_MODE_SW;
+			else if (strcmp(value, "HW") == 0)
+				macro_mode = K90_MACRO_MODE_HW;
+			else
+				goto out;
+		} else {
+			goto out;
+		}
+	}
+
+	if (current_profile > 0 &&
+	    READ_ONCE(drvdata->current_profile) != current_profile) {
+		ret = k90_set_current_profile(hdev, current_profile);
+		if (ret != 0)
+			goto out;
+	}
+	if (macro_mode >= 0 && READ_ONCE(drvdata->macro_mode) != macro_mode) {
+		ret = k90_set_macro_mode(hdev, macro_mode, true);
+		if (ret != 0) {
+			k90_warn(drvdata->ctrl, dev,
+				 "Failed to set macro mode.\n");
+			goto out;
+		}
+	}
+	/* Through the LED so that its brightness stays consistent */
+	if (brightness >= 0 && READ_ONCE(drvdata->brightness) != brightness)
+		led_set_brightness(&backlight->cdev, brightness);
+	ret = count;
+out:
+	kfree(str);
+	return ret;
+}
+
+/*
+ * Profile upload
+ *
+ * A profile is written as the request 16 bindings, immediately followed by
+ * the request 18 macro data and the request 22 key roles. The bindings
+ * header gives the size of the bindings and of the macro data, the key
+ * roles are one count byte followed by two bytes per key.
+ */
+
+#define K90_BINDING_SIZE	5
+#define K90_BINDINGS_HEADER_SIZE	5
+#define K90_BINDINGS_MAX_SIZE	(K90_BINDINGS_HEADER_SIZE + \
+				 K90_GKEY_COUNT * K90_BINDING_SIZE)
+#define K90_MACRO_DATA_MAX_SIZE	(K90_GKEY_COUNT * K90_MACRO_MAX_SIZE)
+#define K90_KEY_ROLES_MAX_SIZE	64
+#define K90_PROFILE_MAX_SIZE	(K90_BINDINGS_MAX_SIZE + \
+				 K90_MACRO_DATA_MAX_SIZE + \
+				 K90_KEY_ROLES_MAX_SIZE)
+
+struct k90_profile_layout {
+	size_t bindings_size;
+	size_t macro_data_size;
+	size_t key_roles_size;
+};
+
+#define K90_BINDING_DISABLED	0x00
+#define K90_BINDING_KEY		0x10
+#define K90_BINDING_MACRO	0x20
+
+#define K90_MACRO_ITEM_SIZE	3
+#define K90_MACRO_ITEM_KEY	0x84
+#define K90_MACRO_ITEM_END	0x86
+#define K90_MACRO_ITEM_DELAY	0x87
+
+#define K90_PLAYBACK_ONCE	1
+#define K90_PLAYBACK_HELD	2
+#define K90_PLAYBACK_TOGGLE	3
+
+/* List of the problems found in a profile, one per line */
+struct k90_report {
+	char *buf;
+	size_t size;
+	size_t len;
+	int count;
+};
+
+#define k90_violation(report, fmt, ...)					\
+do {									\
+	(report)->count++;						\
+	(report)->len += scnprintf((report)->buf + (report)->len,	\
+				   (report)->size - (report)->len,	\
+				   fmt "\n", ##__VA_ARGS__);		\
+} while (0)
+
+static void k90_validate_macro(const u8 *macro, unsigned int length,
+			       unsigned int index, struct k90_report *report)
+{
+	unsigned int pos;
+	bool ended = false;
+
+	for (pos = 0; pos < length; pos += K90_MACRO_ITEM_SIZE) {
+		if (ended) {
+			k90_violation(report, "binding %u: data after the end of the macro at offset %u",
+				      index, pos);
+			return;
+		}
+		if (pos + K90_MACRO_ITEM_SIZE > length) {
+			k90_violation(report, "binding %u: truncated item at offset %u",
+				      index, pos);
+			return;
+		}
+		switch (macro[pos]) {
+		case K90_MACRO_ITEM_KEY:
+			if (macro[pos + 2] > 1)
+				k90_violation(report, "binding %u: invalid key state %u at offset %u",
+					      index, macro[pos + 2], pos);
+			break;
+		case K90_MACRO_ITEM_DELAY:
+			break;
+		case K90_MACRO_ITEM_END:
+			if (get_unaligned_be16(&macro[pos + 1]) == 0)
+				k90_violation(report, "binding %u: null repeat count at offset %u",
+					      index, pos);
+			ended = true;
+			break;
+		default:
+			k90_violation(report, "binding %u: unknown item 0x%02x at offset %u",
+				      index, macro[pos], pos);
+			return;
+		}
+	}
+	if (!ended)
+		k90_violation(report, "binding %u: macro has no end item",
+			      index);
+}
+
+/*
+ * Check a profile before sending it, the keyboard blocks until reset on
+ * some invalid data. Returns the number of problems found, they are
+ * described in report.
+ */
+static int k90_validate_profile(const char *data, size_t size,
+				struct k90_profile_layout *layout,
+				struct k90_report *report)
+{
+	const u8 *p = (const u8 *)data;
+	const u8 *binding, *macro_data, *key_roles;
+	unsigned int bind_count, key_count;
+	unsigned int type, offset, length, playback;
+	int i;
+
+	if (size < K90_BINDINGS_HEADER_SIZE) {
+		k90_violation(report, "profile is shorter than the bindings header (%zu bytes)",
+			      size);
+		return report->count;
+	}
+	bind_count = p[0];
+	layout->bindings_size = get_unaligned_be16(&p[1]);
+	layout->macro_data_size = get_unaligned_be16(&p[3]);
+	if (bind_count > K90_GKEY_COUNT)
+		k90_violation(report, "bind count %u is greater than %d",
+			      bind_count, K90_GKEY_COUNT);
+	if (layout->bindings_size !=
+	    K90_BINDINGS_HEADER_SIZE + bind_count * K90_BINDING_SIZE)
+		k90_violation(report, "bindings size %zu does not match the bind count %u",
+			      layout->bindings_size, bind_count);
+	if (layout->macro_data_size > K90_MACRO_DATA_MAX_SIZE)
+		k90_violation(report, "macro data size %zu is greater than %d",
+			      layout->macro_data_size,
+			      K90_MACRO_DATA_MAX_SIZE);
+	if (report->count > 0)
+		return report->count;
+
+	if (size <= layout->bindings_size + layout->macro_data_size) {
+		k90_violation(report, "profile is truncated before the key roles (%zu bytes)",
+			      size);
+		return report->count;
+	}
+	binding = p + K90_BINDINGS_HEADER_SIZE;
+	macro_data = p + layout->bindings_size;
+	key_roles = macro_data + layout->macro_data_size;
+	key_count = key_roles[0];
+	layout->key_roles_size = 1 + 2 * key_count;
+	if (key_count > K90_GKEY_COUNT)
+		k90_violation(report, "key count %u is greater than %d",
+			      key_count, K90_GKEY_COUNT);
+	if (layout->key_roles_size > K90_KEY_ROLES_MAX_SIZE)
+		k90_violation(report, "key roles size %zu is greater than %d",
+			      layout->key_roles_size, K90_KEY_ROLES_MAX_SIZE);
+	if (size != layout->bindings_size + layout->macro_data_size +
+		    layout->key_roles_size)
+		k90_violation(report, "profile size %zu does not match its content (%zu bytes)",
+			      size, layout->bindings_size +
+			      layout->macro_data_size +
+			      layout->key_roles_size);
+	if (report->count > 0)
+		return report->count;
+
+	for (i = 0; i < bind_count; i++, binding += K90_BINDING_SIZE) {
+		type = binding[0];
+		offset = get_unaligned_be16(&binding[1]);
+		length = get_unaligned_be16(&binding[3]);
+		switch (type) {
+		case K90_BINDING_DISABLED:
+			if (offset != 0 || length != 0)
+				k90_violation(report, "binding %d: disabled binding is not zeroed",
+					      i + 1);
+			continue;
+		case K90_BINDING_KEY:
+		case K90_BINDING_MACRO:
+			break;
+		default:
+			k90_violation(report, "binding %d: unknown type 0x%02x",
+				      i + 1, type);
+			continue;
+		}
+		if (length == 0 || length > K90_MACRO_MAX_SIZE) {
+			k90_violation(report, "binding %d: length %u is not between 1 and %d",
+				      i + 1, length, K90_MACRO_MAX_SIZE);
+			continue;
+		}
+		if (offset + length > layout->macro_data_size) {
+			k90_violation(report, "binding %d: data at %u-%u is outside of the macro data (%zu bytes)",
+				      i + 1, offset, offset + length - 1,
+				      layout->macro_data_size);
+			continue;
+		}
+		if (type == K90_BINDING_MACRO)
+			k90_validate_macro(macro_data + offset, length, i + 1,
+					   report);
+	}
+
+	for (i = 0; i < key_count; i++) {
+		playback = key_roles[1 + 2 * i + 1];
+		if (playback > K90_PLAYBACK_TOGGLE)
+			k90_violation(report, "key role %d: unknown playback type %u",
+				      i + 1, playback);
+		else if (playback == 0 && i < bind_count &&
+			 p[K90_BINDINGS_HEADER_SIZE + i * K90_BINDING_SIZE] ==
+			 K90_BINDING_MACRO)
+			k90_violation(report, "key role %d: macro binding has no playback type",
+				      i + 1);
+	}
+
+	return report->count;
+}
+
+/*
+ * Software macro playback
+ *
+ * In software mode, the macros of the profiles uploaded through the
+ * driver are played by the driver itself on the input device of the
+ * G-keys. Each G-key has its own player driven by a high resolution timer
+ * so any number of macros can run at once.
+ */
+
+struct k90_macros {
+	struct rcu_head rcu;
+	struct k90_profile_layout layout;
+	u8 data[];
+};
+
+#define K90_PLAYBACK_MIN_LOOP_MS	1
+
+/*
+ * Usages are sent with the key codes that hid-input gives them on the
+ * input device, including the changes made with EVIOCSKEYCODE. Interface 0
+ * reports the whole keyboard page for the hardware playback.
+ */
+static void k90_player_key(struct k90_player *player, u8 usage, bool pressed)
+{
+	struct input_dev *input = player->drvdata->input;
+	struct input_keymap_entry ke;
+
+	corsair_keymap_entry(&ke, usage, KEY_RESERVED);
+	if (input_get_keycode(input, &ke) != 0 || ke.keycode == KEY_RESERVED)
+		return;
+	if (pressed)
+		__set_bit(ke.keycode, player->pressed);
+	else
+		__clear_bit(ke.keycode, player->pressed);
+	input_event(input, EV_KEY, ke.keycode, pressed);
+}
+
+static void k90_player_finish(struct k90_player *player)
+{
+	struct input_dev *input = player->drvdata->input;
+	unsigned int code;
+
+	/* By key code, the keymap may have changed since they were pressed */
+	for_each_set_bit(code, player->pressed, KEY_CNT)
+		input_event(input, EV_KEY, code, 0);
+	bitmap_zero(player->pressed, KEY_CNT);
+	input_sync(input);
+	player->active = false;
+}
+
+/*
+ * Run the macro until the next delay, returns the delay in milliseconds or
+ * 0 when the playback is finished. Called with the player lock held.
+ */
+static unsigned int k90_player_run(struct k90_player *player)
+{
+	const u8 *item;
+	unsigned int delay;
+	bool loop;
+
+	while (player->pos + K90_MACRO_ITEM_SIZE <= player->length) {
+		item = &player->items[player->pos];
+		player->pos += K90_MACRO_ITEM_SIZE;
+		switch (item[0]) {
+		case K90_MACRO_ITEM_KEY:
+			k90_player_key(player, item[1], item[2]);
+			break;
+
+		case K90_MACRO_ITEM_DELAY:
+			delay = get_unaligned_be16(&item[1]);
+			if (delay == 0)
+				break;
+			player->delayed = true;
+			input_sync(player->drvdata->input);
+			return delay;
+
+		case K90_MACRO_ITEM_END:
+			switch (player->playback) {
+			case K90_PLAYBACK_HELD:
+				loop = player->held;
+				break;
+			case K90_PLAYBACK_TOGGLE:
+				loop = !player->stop;
+				break;
+			default:
+				loop = ++player->iteration <
+				       get_unaligned_be16(&item[1]);
+				break;
+			}
+			if (!loop)
+				goto finish;
+			player->pos = 0;
+			/* Do not spin on macros without delays */
+			if (!player->delayed) {
+				input_sync(player->drvdata->input);
+				return K90_PLAYBACK_MIN_LOOP_MS;
+			}
+			player->delayed = false;
+			break;
+
+		default:
+			goto finish;
+		}
+	}
+finish:
+	k90_player_finish(player);
+	return 0;
+}
+
+static enum hrtimer_restart k90_player_timer(struct hrtimer *timer)
+{
+	struct k90_player *player = container_of(timer, struct k90_player,
+						 timer);
+	unsigned long flags;
+	unsigned int delay;
+
+	spin_lock_irqsave(&player->lock, flags);
+	delay = player->active ? k90_player_run(player) : 0;
+	spin_unlock_irqrestore(&player->lock, flags);
+
+	if (delay == 0)
+		return HRTIMER_NORESTART;
+
+	/* Relative to the previous expiry so that delays do not drift */
+	hrtimer_add_expires_ns(timer, (u64)delay * NSEC_PER_MSEC);
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Handle a G-key event in software mode, returns true if the key is bound
+ * to a macro of the current profile. Called from the event callback.
+ */
+static bool k90_play_gkey(struct corsair_drvdata *drvdata,
+			  struct k90_drvdata *k90, int gkey, bool pressed)
+{
+	struct k90_player *player = &k90->players[gkey];
+	struct k90_macros *macros;
+	const u8 *binding, *key_roles;
+	unsigned int offset, length, i;
+	int profile = READ_ONCE(drvdata->current_profile);
+	unsigned long flags;
+	bool handled = false;
+
+	if (!READ_ONCE(sw_playback) || !drvdata->input ||
+	    READ_ONCE(drvdata->macro_mode) != K90_MACRO_MODE_SW ||
+	    profile < 1 || profile > 3)
+		return false;
+
+	rcu_read_lock();
+	macros = rcu_dereference(k90->macros[profile - 1]);
+	if (!macros || gkey >= macros->data[0])
+		goto out;
+	binding = &macros->data[K90_BINDINGS_HEADER_SIZE +
+				gkey * K90_BINDING_SIZE];
+	offset = macros->layout.bindings_size +
+		 get_unaligned_be16(&binding[1]);
+	length = get_unaligned_be16(&binding[3]);
+	key_roles = &macros->data[macros->layout.bindings_size +
+				  macros->layout.macro_data_size];
+
+	spin_lock_irqsave(&player->lock, flags);
+	if (k90->playback_stopped)
+		goto out_unlock;
+
+	switch (binding[0]) {
+	case K90_BINDING_KEY:
+		/* Key usages are pressed as long as the G-key */
+		for (i = 0; i < length; i++)
+			k90_player_key(player, macros->data[offset + i],
+				       pressed);
+		input_sync(drvdata->input);
+		handled = true;
+		break;
+
+	case K90_BINDING_MACRO:
+		handled = true;
+		if (!pressed) {
+			player->held = false;
+			break;
+		}
+		if (player->active) {
+			player->stop = true;
+			break;
+		}
+		memcpy(player->items, &macros->data[offset], length);
+		player->length = length;
+		player->pos = 0;
+		player->iteration = 0;
+		player->delayed = false;
+		player->playback = gkey < key_roles[0] ?
+				   key_roles[2 + 2 * gkey] :
+				   K90_PLAYBACK_ONCE;
+		player->held = true;
+		player->stop = false;
+		player->active = true;
+		/*
+		 * Under the lock, so that k90_stop_playback() either prevents
+		 * this or cancels the timer after it is started.
+		 */
+		hrtimer_start(&player->timer, 0, HRTIMER_MODE_REL);
+		break;
+	}
+out_unlock:
+	spin_unlock_irqrestore(&player->lock, flags);
+out:
+	rcu_read_unlock();
+
+	return handled;
+}
+
+static void k90_init_playback(struct corsair_drvdata *drvdata)
+{
+	struct k90_drvdata *k90 = drvdata->k90;
+	struct k90_player *player;
+	int i;
+
+	for (i = 0; i < K90_GKEY_COUNT; i++) {
+		player = &k90->players[i];
+		spin_lock_init(&player->lock);
+		player->drvdata = drvdata;
+		hrtimer_init(&player->timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		player->timer.function = k90_player_timer;
+	}
+}
+
+/* Stop a macro and release its keys, called with the player lock held */
+static void k90_player_stop(struct k90_player *player)
+{
+	if (player->active || !bitmap_empty(player->pressed, KEY_CNT))
+		k90_player_finish(player);
+}
+
+/*
+ * Stop the macros and release the keys pressed by the bindings of the
+ * previous profile when switching profile, the G-keys would be released
+ * with the bindings of the new one. May be called from atomic context, the
+ * timers stop by themselves once their player is inactive.
+ */
+static void k90_release_players(struct k90_drvdata *k90)
+{
+	struct k90_player *player;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < K90_GKEY_COUNT; i++) {
+		player = &k90->players[i];
+		spin_lock_irqsave(&player->lock, flags);
+		k90_player_stop(player);
+		spin_unlock_irqrestore(&player->lock, flags);
+	}
+}
+
+static void k90_stop_playback(struct k90_drvdata *k90)
+{
+	struct k90_player *player;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < K90_GKEY_COUNT; i++) {
+		player = &k90->players[i];
+		spin_lock_irqsave(&player->lock, flags);
+		k90->playback_stopped = true;
+		k90_player_stop(player);
+		spin_unlock_irqrestore(&player->lock, flags);
+		hrtimer_cancel(&player->timer);
+	}
+}
+
+/* Keep a copy of an uploaded profile for software playback */
+static void k90_set_macros(struct k90_drvdata *k90, int profile,
+			   const char *data,
+			   const struct k90_profile_layout *layout)
+{
+	struct k90_macros *macros, *old;
+	size_t size = layout->bindings_size + layout->macro_data_size +
+		      layout->key_roles_size;
+
+	macros = kmalloc(sizeof(struct k90_macros) + size, GFP_KERNEL);
+	if (macros) {
+		macros->layout = *layout;
+		memcpy(macros->data, data, size);
+	}
+
+	mutex_lock(&k90->lock);
+	old = rcu_replace_pointer(k90->macros[profile - 1], macros,
+				  lockdep_is_held(&k90->lock));
+	mutex_unlock(&k90->lock);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+struct k90_upload {
+	atomic_t remaining;
+	int result;
+	struct completion done;
+};
+
+static void k90_upload_complete(void *context, int result, const char *data)
+{
+	struct k90_upload *upload = context;
+
+	if (result < 0 && upload->result == 0)
+		upload->result = result;
+	if (atomic_dec_and_test(&upload->remaining))
+		complete(&upload->done);
+}
+
+static int k90_upload_profile(struct hid_device *dev, int profile,
+			      const char *data,
+			      const struct k90_profile_layout *layout)
+{
+	int ret = 0;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	struct k90_ctrl *ctrl = drvdata->ctrl;
+	static const __u8 requests[] = {
+		K90_REQUEST_BINDINGS,
+		K90_REQUEST_MACRO_DATA,
+		K90_REQUEST_KEY_ROLES,
+	};
+	size_t sizes[] = {
+		layout->bindings_size,
+		layout->macro_data_size,
+		layout->key_roles_size,
+	};
+	struct k90_upload upload;
+	char *buf;
+	size_t offset = 0;
+	int i;
+
+	buf = kmemdup(data, sizes[0] + sizes[1] + sizes[2], GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	atomic_set(&upload.remaining, 1);
+	upload.result = 0;
+	init_completion(&upload.done);
+
+	/*
+	 * The three requests are queued back to back without waiting for
+	 * each other. Uploads are serialized so that requests of two uploads
+	 * are not interleaved.
+	 */
+	mutex_lock(&drvdata->upload_lock);
+	for (i = 0; i < ARRAY_SIZE(requests); i++) {
+		atomic_inc(&upload.remaining);
+		wait_event(ctrl->wait,
+			   (ret = k90_ctrl_submit_dma(ctrl, requests[i],
+						      USB_DIR_OUT, 0, profile,
+						      buf + offset, sizes[i],
+						      k90_upload_complete,
+						      &upload)) != -EBUSY);
+		if (ret < 0) {
+			atomic_dec(&upload.remaining);
+			break;
+		}
+		offset += sizes[i];
+	}
+	mutex_unlock(&drvdata->upload_lock);
+
+	if (!atomic_dec_and_test(&upload.remaining))
+		wait_for_completion(&upload.done);
+	kfree(buf);
+
+	if (ret == 0)
+		ret = upload.result;
+	if (ret < 0) {
+		k90_warn(ctrl, &dev->dev,
+			 "Failed to upload profile %d (error %d).\n",
+			 profile, ret);
+		return ret;
+	}
+
+	k90_set_macros(drvdata->k90, profile, data, layout);
+	return 0;
+}
+
+static ssize_t k90_write_profile(struct file *file, struct kobject *kobj,
+				 struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+{
+	int ret;
+	struct hid_device *hdev = to_hid_device(kobj_to_dev(kobj));
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+	struct k90_drvdata *k90 = drvdata->k90;
+	int profile = (long)attr->private;
+	struct k90_profile_layout layout;
+	struct k90_report report;
+
+	/* The whole profile must be written at once */
+	if (off != 0)
+		return -EINVAL;
+
+	report.buf = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!report.buf)
+		return -ENOMEM;
+	report.size = PAGE_SIZE;
+	report.len = 0;
+	report.count = 0;
+
+	k90_validate_profile(buf, count, &layout, &report);
+
+	mutex_lock(&k90->report_lock);
+	kfree(k90->profile_report);
+	k90->profile_report = report.buf;
+	mutex_unlock(&k90->report_lock);
+
+	if (report.count > 0) {
+		hid_warn(hdev, "Invalid data for profile %d, see profile_report.\n",
+			 profile);
+		return -EINVAL;
+	}
+	if (READ_ONCE(k90->profile_dry_run))
+		return count;
+
+	ret = k90_upload_profile(hdev, profile, buf, &layout);
+	if (ret != 0)
+		return ret;
+
+	return count;
+}
+
+static ssize_t k90_show_profile_report(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	struct k90_drvdata *k90 = drvdata->k90;
+	ssize_t ret;
+
+	mutex_lock(&k90->report_lock);
+	ret = snprintf(buf, PAGE_SIZE, "%s",
+		       k90->profile_report ? k90->profile_report : "");
+	mutex_unlock(&k90->report_lock);
+
+	return ret;
+}
+
+static ssize_t k90_show_profile_dry_run(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE, "%d\n",
+			READ_ONCE(drvdata->k90->profile_dry_run));
+}
+
+static ssize_t k90_store_profile_dry_run(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	bool dry_run;
+
+	if (kstrtobool(buf, &dry_run))
+		return -EINVAL;
+	WRITE_ONCE(drvdata->k90->profile_dry_run, dry_run);
+
+	return count;
+}
+
+/*
+ * Macro recording
+ *
+ * Between the MR start and stop usages, the key events of the regular keys
+ * interface (which must be bound to this driver) are recorded with their
+ * time. They can be read as K90 macro items from recorded_macro.
+ */
+
+/* Recordings are truncated to what the keyboard accepts as one macro */
+#define K90_RECORD_MAX_SIZE	K90_MACRO_MAX_SIZE
+
+/* Interface 0 of the bound keyboards, for the other interfaces */
+static LIST_HEAD(k90_devices);
+static DEFINE_SPINLOCK(k90_devices_lock);
+/* Number of keyboards currently recording */
+static atomic_t k90_recordings = ATOMIC_INIT(0);
+
+static void k90_record_start(struct k90_drvdata *k90)
+{
+	struct k90_recorder *rec = &k90->recorder;
+
+	atomic_inc(&rec->session);
+	if (!test_and_set_bit(0, &rec->active))
+		atomic_inc(&k90_recordings);
+}
+
+static void k90_record_stop(struct k90_drvdata *k90)
+{
+	struct k90_recorder *rec = &k90->recorder;
+
+	if (test_and_clear_bit(0, &rec->active))
+		atomic_dec(&k90_recordings);
+}
+
+/* Called from the event callback of the other interfaces */
+static void k90_record_key(struct corsair_drvdata *drvdata,
+			   unsigned int usage, bool pressed)
+{
+	struct corsair_drvdata *iface0;
+	struct k90_drvdata *k90;
+	struct k90_recorder *rec;
+	struct k90_record_event event;
+	unsigned int session;
+
+	if (atomic_read(&k90_recordings) == 0)
+		return;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(iface0, &k90_devices, node) {
+		if (iface0->usbdev != drvdata->usbdev)
+			continue;
+		k90 = READ_ONCE(iface0->k90);
+		if (!k90 || !test_bit(0, &k90->recorder.active))
+			break;
+		rec = &k90->recorder;
+
+		session = atomic_read(&rec->session);
+		if (rec->producer_session != session) {
+			rec->producer_session = session;
+			bitmap_zero(rec->keys, 256);
+		}
+		/* Variable fields report every key in every report */
+		if (pressed == test_bit(usage, rec->keys))
+			break;
+		if (pressed)
+			__set_bit(usage, rec->keys);
+		else
+			__clear_bit(usage, rec->keys);
+
+		event.time = ktime_get_ns();
+		event.session = session;
+		event.usage = usage;
+		event.pressed = pressed;
+		if (!kfifo_put(&rec->ring, event))
+			atomic_inc(&rec->overflows);
+		break;
+	}
+	rcu_read_unlock();
+}
 
-static enum led_brightness k90_backlight_get(struct led_classdev *led_cdev)
+/* Move the events of the last session from the ring, with read_lock held */
+static void k90_record_drain(struct k90_recorder *rec)
 {
-	int ret;
-	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
-	struct device *dev = led->cdev.dev->parent;
-	struct usb_interface *usbif = to_usb_interface(dev->parent);
-	struct usb_device *usbdev = interface_to_usbdev(usbif);
-	int brightness;
-	char data[8];
+	struct k90_record_event event;
+	unsigned int session = atomic_read(&rec->session);
 
-	ret = usb_control_msg(usbdev, usb_rcvctrlpipe(usbdev, 0),
-			      K90_REQUEST_STATUS,
-			      USB_DIR_IN | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, 0, 0, data, 8,
-			      USB_CTRL_SET_TIMEOUT);
-	if (ret < 0) {
-		dev_warn(dev, "Failed to get K90 initial state (error %d).\n",
-			 ret);
-		return -EIO;
+	if (rec->session_read != session) {
+		rec->session_read = session;
+		rec->count = 0;
 	}
-	brightness = data[4];
-	if (brightness < 0 || brightness > 3) {
-		dev_warn(dev,
-			 "Read invalid backlight brightness: %02hhx.\n",
-			 data[4]);
-		return -EIO;
+	while (kfifo_get(&rec->ring, &event)) {
+		if (event.session != session)
+			continue;
+		if (rec->count < K90_RECORD_MAX_EVENTS)
+			rec->events[rec->count++] = event;
+		else
+			atomic_inc(&rec->overflows);
 	}
-	return brightness;
 }
 
-static enum led_brightness k90_record_led_get(struct led_classdev *led_cdev)
+/*
+ * Encode the recorded events, ending with a play once item. Events that
+ * would not leave room for the end item in K90_RECORD_MAX_SIZE are dropped
+ * and *truncated is set.
+ */
+static size_t k90_record_encode(struct k90_recorder *rec, u8 *buf,
+				bool *truncated)
 {
-	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
+	size_t len = 0, needed;
+	u64 delay = 0;
+	int i;
+
+	*truncated = false;
+	for (i = 0; i < rec->count; i++) {
+		if (i > 0)
+			delay = div_u64(rec->events[i].time -
+					rec->events[i - 1].time,
+					NSEC_PER_MSEC);
+		needed = (delay > 0 ? 2 : 1) * K90_MACRO_ITEM_SIZE;
+		if (len + needed + K90_MACRO_ITEM_SIZE > K90_RECORD_MAX_SIZE) {
+			*truncated = true;
+			break;
+		}
+		if (delay > 0) {
+			buf[len] = K90_MACRO_ITEM_DELAY;
+			put_unaligned_be16(min_t(u64, delay, 0xffff),
+					   &buf[len + 1]);
+			len += K90_MACRO_ITEM_SIZE;
+		}
+		buf[len] = K90_MACRO_ITEM_KEY;
+		buf[len + 1] = rec->events[i].usage;
+		buf[len + 2] = rec->events[i].pressed;
+		len += K90_MACRO_ITEM_SIZE;
+	}
+	buf[len] = K90_MACRO_ITEM_END;
+	put_unaligned_be16(1, &buf[len + 1]);
+	len += K90_MACRO_ITEM_SIZE;
 
-	return led->brightness;
+	return len;
 }
 
-static void k90_brightness_set(struct led_classdev *led_cdev,
-			       enum led_brightness brightness)
+static ssize_t k90_read_recorded_macro(struct file *file,
+				       struct kobject *kobj,
+				       struct bin_attribute *attr, char *buf,
+				       loff_t off, size_t count)
 {
-	struct k90_led *led = container_of(led_cdev, struct k90_led, cdev);
+	struct corsair_drvdata *drvdata = dev_get_drvdata(kobj_to_dev(kobj));
+	struct k90_recorder *rec = &drvdata->k90->recorder;
+	u8 *data;
+	size_t len;
+	bool truncated;
+
+	data = kmalloc(K90_RECORD_MAX_SIZE, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
 
-	led->brightness = brightness;
-	schedule_work(&led->work);
-}
+	mutex_lock(&rec->read_lock);
+	k90_record_drain(rec);
+	len = k90_record_encode(rec, data, &truncated);
+	mutex_unlock(&rec->read_lock);
+	if (truncated)
+		dev_warn_ratelimited(kobj_to_dev(kobj),
+				     "Recorded macro truncated to %d bytes.\n",
+				     K90_RECORD_MAX_SIZE);
+
+	if (off >= len) {
+		count = 0;
+	} else {
+		count = min_t(size_t, count, len - off);
+		memcpy(buf, data + off, count);
+	}
+	kfree(data);
 
-static void k90_backlight_work(struct work_struct *work)
-{
-	int ret;
-	struct k90_led *led = container_of(work, struct k90_led, work);
-	struct device *dev;
-	struct usb_interface *usbif;
-	struct usb_device *usbdev;
+	return count;
+}
 
-	if (led->removed)
-		return;
+static BIN_ATTR(recorded_macro, 0444, k90_read_recorded_macro, NULL,
+		K90_RECORD_MAX_SIZE);
 
-	dev = led->cdev.dev->parent;
-	usbif = to_usb_interface(dev->parent);
-	usbdev = interface_to_usbdev(usbif);
+static ssize_t k90_show_record_overflows(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
 
-	ret = usb_control_msg(usbdev, usb_sndctrlpipe(usbdev, 0),
-			      K90_REQUEST_BRIGHTNESS,
-			      USB_DIR_OUT | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, led->brightness, 0,
-			      NULL, 0, USB_CTRL_SET_TIMEOUT);
-	if (ret != 0)
-		dev_warn(dev, "Failed to set backlight brightness (error: %d).\n",
-			 ret);
+	return snprintf(buf, PAGE_SIZE, "%d\n",
+			atomic_read(&drvdata->k90->recorder.overflows));
 }
 
-static void k90_record_led_work(struct work_struct *work)
+static void k90_init_recorder(struct corsair_drvdata *drvdata)
 {
-	int ret;
-	struct k90_led *led = container_of(work, struct k90_led, work);
-	struct device *dev;
-	struct usb_interface *usbif;
-	struct usb_device *usbdev;
-	int value;
+	struct k90_recorder *rec = &drvdata->k90->recorder;
 
-	if (led->removed)
-		return;
+	INIT_KFIFO(rec->ring);
+	mutex_init(&rec->read_lock);
 
-	dev = led->cdev.dev->parent;
-	usbif = to_usb_interface(dev->parent);
-	usbdev = interface_to_usbdev(usbif);
+	spin_lock(&k90_devices_lock);
+	list_add_rcu(&drvdata->node, &k90_devices);
+	spin_unlock(&k90_devices_lock);
+}
 
-	if (led->brightness > 0)
-		value = K90_MACRO_LED_ON;
-	else
-		value = K90_MACRO_LED_OFF;
+/* The caller must wait for an RCU grace period */
+static void k90_cleanup_recorder(struct corsair_drvdata *drvdata)
+{
+	k90_record_stop(drvdata->k90);
 
-	ret = usb_control_msg(usbdev, usb_sndctrlpipe(usbdev, 0),
-			      K90_REQUEST_MACRO_MODE,
-			      USB_DIR_OUT | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, value, 0, NULL, 0,
-			      USB_CTRL_SET_TIMEOUT);
-	if (ret != 0)
-		dev_warn(dev, "Failed to set record LED state (error: %d).\n",
-			 ret);
+	spin_lock(&k90_devices_lock);
+	list_del_rcu(&drvdata->node);
+	spin_unlock(&k90_devices_lock);
 }
 
 /*
- * Keyboard attributes
+ * Profile bundles
+ *
+ * Each profile can have a bundle of G-key codes, backlight brightness and
+ * macro mode applied by the event callback when the keyboard switches to
+ * that profile. Bundles are replaced with RCU, the event callback only
+ * reads them.
  */
 
-static ssize_t k90_show_macro_mode(struct device *dev,
-				   struct device_attribute *attr, char *buf)
-{
-	int ret;
-	struct usb_interface *usbif = to_usb_interface(dev->parent);
-	struct usb_device *usbdev = interface_to_usbdev(usbif);
-	const char *macro_mode;
-	char data[8];
-
-	ret = usb_control_msg(usbdev, usb_rcvctrlpipe(usbdev, 0),
-			      K90_REQUEST_GET_MODE,
-			      USB_DIR_IN | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, 0, 0, data, 2,
-			      USB_CTRL_SET_TIMEOUT);
-	if (ret < 0) {
-		dev_warn(dev, "Failed to get K90 initial mode (error %d).\n",
-			 ret);
-		return -EIO;
-	}
+#define K90_BUNDLE_GKEYS	BIT(0)
+#define K90_BUNDLE_BRIGHTNESS	BIT(1)
+#define K90_BUNDLE_MACRO_MODE	BIT(2)
 
-	switch (data[0]) {
-	case K90_MACRO_MODE_HW:
-		macro_mode = "HW";
-		break;
+struct k90_bundle {
+	struct rcu_head rcu;
+	unsigned long fields;	/* K90_BUNDLE_* of the values set */
+	u16 gkey_codes[K90_GKEY_COUNT];
+	/* gkey_codes as prepared for input_set_keycode() */
+	struct input_keymap_entry gkeys[K90_GKEY_COUNT];
+	int brightness;
+	int macro_mode;
+};
 
-	case K90_MACRO_MODE_SW:
-		macro_mode = "SW";
-		break;
-	default:
-		dev_warn(dev, "K90 in unknown mode: %02hhx.\n",
-			 data[0]);
-		return -EIO;
+/* Called from the event callback when switching to profile */
+static void k90_apply_bundle(struct hid_device *hdev, struct k90_drvdata *k90,
+			     int profile)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+	struct k90_led *backlight = READ_ONCE(drvdata->backlight);
+	struct k90_bundle *bundle;
+	int i;
+
+	rcu_read_lock();
+	bundle = rcu_dereference(k90->bundles[profile - 1]);
+	if (!bundle) {
+		/* Profiles without a bundle use the default keymap */
+		if (k90->gkeys_replaced && drvdata->input)
+			for (i = 0; i < K90_GKEY_COUNT; i++)
+				input_set_keycode(drvdata->input,
+						  &k90->default_gkeys[i]);
+		k90->gkeys_replaced = false;
+		goto out;
 	}
 
-	return snprintf(buf, PAGE_SIZE, "%s\n", macro_mode);
+	if ((bundle->fields & K90_BUNDLE_GKEYS) && drvdata->input) {
+		if (!k90->gkeys_replaced) {
+			for (i = 0; i < K90_GKEY_COUNT; i++) {
+				corsair_keymap_entry(&k90->default_gkeys[i],
+					corsair_class_usage(CORSAIR_CLASS_GKEY,
+							    i),
+					KEY_RESERVED);
+				input_get_keycode(drvdata->input,
+						  &k90->default_gkeys[i]);
+			}
+			k90->gkeys_replaced = true;
+		}
+		for (i = 0; i < K90_GKEY_COUNT; i++)
+			input_set_keycode(drvdata->input, &bundle->gkeys[i]);
+	}
+	if ((bundle->fields & K90_BUNDLE_BRIGHTNESS) && backlight)
+		led_set_brightness(&backlight->cdev, bundle->brightness);
+	if ((bundle->fields & K90_BUNDLE_MACRO_MODE) &&
+	    READ_ONCE(drvdata->macro_mode) != bundle->macro_mode &&
+	    k90_set_macro_mode(hdev, bundle->macro_mode, false) != 0)
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to set macro mode of profile %d.\n",
+			 profile);
+out:
+	rcu_read_unlock();
 }
 
-static ssize_t k90_store_macro_mode(struct device *dev,
-				    struct device_attribute *attr,
-				    const char *buf, size_t count)
+static int k90_parse_bundle(char *str, struct k90_bundle *bundle)
 {
-	int ret;
-	struct usb_interface *usbif = to_usb_interface(dev->parent);
-	struct usb_device *usbdev = interface_to_usbdev(usbif);
-	__u16 value;
-
-	if (strncmp(buf, "SW", 2) == 0)
-		value = K90_MACRO_MODE_SW;
-	else if (strncmp(buf, "HW", 2) == 0)
-		value = K90_MACRO_MODE_HW;
-	else
-		return -EINVAL;
-
-	ret = usb_control_msg(usbdev, usb_sndctrlpipe(usbdev, 0),
-			      K90_REQUEST_MACRO_MODE,
-			      USB_DIR_OUT | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, value, 0, NULL, 0,
-			      USB_CTRL_SET_TIMEOUT);
-	if (ret != 0) {
-		dev_warn(dev, "Failed to set macro mode.\n");
-		return ret;
+	char *token, *value;
+	int i, ret;
+
+	while ((token = strsep(&str, " \t\n")) != NULL) {
+		if (*token == '\0')
+			continue;
+		value = strchr(token, '=');
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+
+		if (strcmp(token, "gkey_codes") == 0) {
+			ret = corsair_parse_keycodes(value, bundle->gkey_codes,
+						     K90_GKEY_COUNT);
+			if (ret != 0)
+				return ret;
+			for (i = 0; i < K90_GKEY_COUNT; i++)
+				corsair_keymap_entry(&bundle->gkeys[i],
+					corsair_class_usage(CORSAIR_CLASS_GKEY,
+							    i),
+					bundle->gkey_codes[i]);
+			bundle->fields |= K90_BUNDLE_GKEYS;
+		} else if (strcmp(token, "brightness") == 0) {
+			if (kstrtoint(value, 10, &bundle->brightness) ||
+			    bundle->brightness < 0 || bundle->brightness > 3)
+				return -EINVAL;
+			bundle->fields |= K90_BUNDLE_BRIGHTNESS;
+		} else if (strcmp(token, "macro_mode") == 0) {
+			if (strcmp(value, "SW") == 0)
+				bundle->macro_mode = K90_MACRO_MODE_SW;
+			else if (strcmp(value, "HW") == 0)
+				bundle->macro_mode = K90_MACRO_MODE_HW;
+			else
+				return -EINVAL;
+			bundle->fields |= K90_BUNDLE_MACRO_MODE;
+		} else {
+			return -EINVAL;
+		}
 	}
 
-	return count;
+	return 0;
 }
 
-static ssize_t k90_show_current_profile(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+static ssize_t k90_show_bundle(struct device *dev, int profile, char *buf)
 {
-	int ret;
-	struct usb_interface *usbif = to_usb_interface(dev->parent);
-	struct usb_device *usbdev = interface_to_usbdev(usbif);
-	int current_profile;
-	char data[8];
-
-	ret = usb_control_msg(usbdev, usb_rcvctrlpipe(usbdev, 0),
-			      K90_REQUEST_STATUS,
-			      USB_DIR_IN | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, 0, 0, data, 8,
-			      USB_CTRL_SET_TIMEOUT);
-	if (ret < 0) {
-		dev_warn(dev, "Failed to get K90 initial state (error %d).\n",
-			 ret);
-		return -EIO;
-	}
-	current_profile = data[7];
-	if (current_profile < 1 || current_profile > 3) {
-		dev_warn(dev, "Read invalid current profile: %02hhx.\n",
-			 data[7]);
-		return -EIO;
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	struct k90_drvdata *k90 = drvdata->k90;
+	struct k90_bundle *bundle;
+	ssize_t len = 0;
+	int i;
+
+	rcu_read_lock();
+	bundle = rcu_dereference(k90->bundles[profile - 1]);
+	if (bundle && (bundle->fields & K90_BUNDLE_GKEYS)) {
+		len += snprintf(buf + len, PAGE_SIZE - len, "gkey_codes=");
+		for (i = 0; i < K90_GKEY_COUNT; i++)
+			len += snprintf(buf + len, PAGE_SIZE - len, "%s%u",
+					i > 0 ? "," : "",
+					bundle->gkey_codes[i]);
+		len += snprintf(buf + len, PAGE_SIZE - len, "\n");
 	}
-
-	return snprintf(buf, PAGE_SIZE, "%d\n", current_profile);
+	if (bundle && (bundle->fields & K90_BUNDLE_BRIGHTNESS))
+		len += snprintf(buf + len, PAGE_SIZE - len, "brightness=%d\n",
+				bundle->brightness);
+	if (bundle && (bundle->fields & K90_BUNDLE_MACRO_MODE))
+		len += snprintf(buf + len, PAGE_SIZE - len, "macro_mode=%s\n",
+				bundle->macro_mode == K90_MACRO_MODE_SW ?
+				"SW" : "HW");
+	rcu_read_unlock();
+
+	return len;
 }
 
-static ssize_t k90_store_current_profile(struct device *dev,
-					 struct device_attribute *attr,
-					 const char *buf, size_t count)
+static ssize_t k90_store_bundle(struct device *dev, int profile,
+				const char *buf, size_t count)
 {
+	struct corsair_drvdata *drvdata = dev_get_drvdata(dev);
+	struct k90_drvdata *k90 = drvdata->k90;
+	struct k90_bundle *bundle, *old;
+	char *str;
 	int ret;
-	struct usb_interface *usbif = to_usb_interface(dev->parent);
-	struct usb_device *usbdev = interface_to_usbdev(usbif);
-	int profile;
 
-	if (kstrtoint(buf, 10, &profile))
-		return -EINVAL;
-	if (profile < 1 || profile > 3)
-		return -EINVAL;
+	bundle = kzalloc(sizeof(struct k90_bundle), GFP_KERNEL);
+	if (!bundle)
+		return -ENOMEM;
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str) {
+		kfree(bundle);
+		return -ENOMEM;
+	}
 
-	ret = usb_control_msg(usbdev, usb_sndctrlpipe(usbdev, 0),
-			      K90_REQUEST_PROFILE,
-			      USB_DIR_OUT | USB_TYPE_VENDOR |
-			      USB_RECIP_DEVICE, profile, 0, NULL, 0,
-			      USB_CTRL_SET_TIMEOUT);
+	ret = k90_parse_bundle(str, bundle);
+	kfree(str);
 	if (ret != 0) {
-		dev_warn(dev, "Failed to change current profile (error %d).\n",
-			 ret);
+		kfree(bundle);
 		return ret;
 	}
 
+	/* An empty bundle removes the bundle of the profile */
+	if (!bundle->fields) {
+		kfree(bundle);
+		bundle = NULL;
+	}
+	mutex_lock(&k90->lock);
+	old = rcu_replace_pointer(k90->bundles[profile - 1], bundle,
+				  lockdep_is_held(&k90->lock));
+	mutex_unlock(&k90->lock);
+	if (old)
+		kfree_rcu(old, rcu);
+
 	return count;
 }
 
+#define K90_BUNDLE_ATTR(n)						\
+static ssize_t k90_show_profile##n##_bundle(struct device *dev,		\
+					    struct device_attribute *attr, \
+					    char *buf)			\
+{									\
+	return k90_show_bundle(dev, n, buf);				\
+}									\
+static ssize_t k90_store_profile##n##_bundle(struct device *dev,	\
+					     struct device_attribute *attr, \
+					     const char *buf, size_t count) \
+{									\
+	return k90_store_bundle(dev, n, buf, count);			\
+}									\
+static DEVICE_ATTR(profile##n##_bundle, 0644,				\
+		   k90_show_profile##n##_bundle,			\
+		   k90_store_profile##n##_bundle)
+
+K90_BUNDLE_ATTR(1);
+K90_BUNDLE_ATTR(2);
+K90_BUNDLE_ATTR(3);
+
+#define K90_PROFILE_ATTR(n)						\
+static struct bin_attribute bin_attr_profile##n = {			\
+	.attr = { .name = "profile" #n, .mode = 0200 },			\
+	.size = K90_PROFILE_MAX_SIZE,					\
+	.write = k90_write_profile,					\
+	.private = (void *)n,						\
+}
+
+K90_PROFILE_ATTR(1);
+K90_PROFILE_ATTR(2);
+K90_PROFILE_ATTR(3);
+
 static DEVICE_ATTR(macro_mode, 0644, k90_show_macro_mode, k90_store_macro_mode);
 static DEVICE_ATTR(current_profile, 0644, k90_show_current_profile,
 		   k90_store_current_profile);
+static DEVICE_ATTR(state, 0644, k90_show_state, k90_store_state);
+static DEVICE_ATTR(profile_report, 0444, k90_show_profile_report, NULL);
+static DEVICE_ATTR(record_overflows, 0444, k90_show_record_overflows, NULL);
+static DEVICE_ATTR(profile_dry_run, 0644, k90_show_profile_dry_run,
+		   k90_store_profile_dry_run);
 
 static struct attribute *k90_attrs[] = {
 	&dev_attr_macro_mode.attr,
 	&dev_attr_current_profile.attr,
+	&dev_attr_state.attr,
+	&dev_attr_profile_report.attr,
+	&dev_attr_profile_dry_run.attr,
+	&dev_attr_record_overflows.attr,
+	&dev_attr_profile1_bundle.attr,
+	&dev_attr_profile2_bundle.attr,
+	&dev_attr_profile3_bundle.attr,
+	NULL
+};
+
+static struct bin_attribute *k90_bin_attrs[] = {
+	&bin_attr_profile1,
+	&bin_attr_profile2,
+	&bin_attr_profile3,
+	&bin_attr_recorded_macro,
 	NULL
 };
 
 static const struct attribute_group k90_attr_group = {
 	.attrs = k90_attrs,
+	.bin_attrs = k90_bin_attrs,
 };
 
 /*
  * Driver functions
  */
 
+static int k90_init_control(struct hid_device *dev)
+{
+	int ret;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	struct usb_interface *usbif = to_usb_interface(dev->dev.parent);
+	struct k90_ctrl *ctrl;
+
+	ctrl = kzalloc(sizeof(struct k90_ctrl), GFP_KERNEL);
+	if (!ctrl) {
+		ret = -ENOMEM;
+		goto fail_ctrl_alloc;
+	}
+
+	ret = k90_ctrl_init(ctrl, interface_to_usbdev(usbif));
+	if (ret != 0)
+		goto fail_ctrl_init;
+
+	/*
+	 * Work items of a keyboard are run in order and do not wait behind
+	 * unrelated work or work of other keyboards.
+	 */
+	drvdata->wq = alloc_ordered_workqueue("%s",
+					      ctrl_highpri ? WQ_HIGHPRI : 0,
+					      dev_name(&dev->dev));
+	if (!drvdata->wq) {
+		ret = -ENOMEM;
+		goto fail_wq;
+	}
+	drvdata->ctrl = ctrl;
+
+	k90_init_debugfs(dev);
+
+	return 0;
+
+fail_wq:
+	k90_ctrl_cleanup(ctrl);
+fail_ctrl_init:
+	kfree(ctrl);
+fail_ctrl_alloc:
+	return ret;
+}
+
+/*
+ * Fill in the state still unknown with one status and one mode read. This
+ * is queued at the end of probe so that probing does not wait for the
+ * keyboard.
+ */
+static void k90_init_state_work(struct work_struct *work)
+{
+	int ret;
+	struct corsair_drvdata *drvdata =
+		container_of(work, struct corsair_drvdata, init_work);
+	struct hid_device *hdev = drvdata->hdev;
+	char data[K90_STATUS_SIZE];
+	int brightness;
+
+	ret = k90_get_status(hdev, data);
+	if (ret < 0) {
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to get K90 initial state (error %d).\n",
+			 ret);
+	} else {
+		if (data[4] >= 0 && data[4] <= 3)
+			cmpxchg(&drvdata->brightness, -1, data[4]);
+		if (data[7] >= 1 && data[7] <= 3)
+			cmpxchg(&drvdata->current_profile, -1, data[7]);
+	}
+
+	if (drvdata->k90) {
+		ret = k90_get_mode(hdev, data);
+		if (ret < 0)
+			k90_warn(drvdata->ctrl, &hdev->dev,
+				 "Failed to get K90 initial mode (error %d).\n",
+				 ret);
+		else if (data[0] == K90_MACRO_MODE_HW ||
+			 data[0] == K90_MACRO_MODE_SW)
+			cmpxchg(&drvdata->macro_mode, -1, data[0]);
+	}
+
+	WRITE_ONCE(drvdata->state_ready, true);
+
+	/*
+	 * The LED was registered before the brightness was known, let the
+	 * LED core read it (from the cached value) and tell pollers.
+	 */
+	brightness = READ_ONCE(drvdata->brightness);
+	if (drvdata->backlight && brightness >= 0) {
+		led_update_brightness(&drvdata->backlight->cdev);
+		led_classdev_notify_brightness_hw_changed(
+			&drvdata->backlight->cdev, brightness);
+	}
+}
+
 static int k90_init_backlight(struct hid_device *dev)
 {
 	int ret;
@@ -411,11 +3041,15 @@ static int k90_init_backlight(struct hid_device *dev)
 	snprintf(name, name_sz, "%s" K90_BACKLIGHT_LED_SUFFIX,
 		 dev_name(&dev->dev));
 	drvdata->backlight->removed = false;
+	drvdata->backlight->hdev = dev;
 	drvdata->backlight->cdev.name = name;
 	drvdata->backlight->cdev.max_brightness = 3;
 	drvdata->backlight->cdev.brightness_set = k90_brightness_set;
 	drvdata->backlight->cdev.brightness_get = k90_backlight_get;
-	INIT_WORK(&drvdata->backlight->work, k90_backlight_work);
+	drvdata->backlight->cdev.groups = k90_led_groups;
+	/* The Light key changes the brightness without the driver */
+	drvdata->backlight->cdev.flags = LED_BRIGHT_HW_CHANGED;
+	INIT_DELAYED_WORK(&drvdata->backlight->work, k90_backlight_work);
 	ret = led_classdev_register(&dev->dev, &drvdata->backlight->cdev);
 	if (ret != 0)
 		goto fail_register_cdev;
@@ -445,6 +3079,9 @@ static int k90_init_macro_functions(struct hid_device *dev)
 		goto fail_drvdata;
 	}
 	drvdata->k90 = k90;
+	mutex_init(&k90->lock);
+	mutex_init(&k90->report_lock);
+	k90_init_playback(drvdata);
 
 	/* Init LED device for record LED */
 	name_sz = strlen(dev_name(&dev->dev)) + sizeof(K90_RECORD_LED_SUFFIX);
@@ -456,11 +3093,14 @@ static int k90_init_macro_functions(struct hid_device *dev)
 	snprintf(name, name_sz, "%s" K90_RECORD_LED_SUFFIX,
 		 dev_name(&dev->dev));
 	k90->record_led.removed = false;
+	k90->record_led.hdev = dev;
 	k90->record_led.cdev.name = name;
 	k90->record_led.cdev.max_brightness = 1;
 	k90->record_led.cdev.brightness_set = k90_brightness_set;
 	k90->record_led.cdev.brightness_get = k90_record_led_get;
-	INIT_WORK(&k90->record_led.work, k90_record_led_work);
+	k90->record_led.cdev.blink_set = k90_record_led_blink_set;
+	k90->record_led.cdev.groups = k90_led_groups;
+	INIT_DELAYED_WORK(&k90->record_led.work, k90_record_led_work);
 	k90->record_led.brightness = 0;
 	ret = led_classdev_register(&dev->dev, &k90->record_led.cdev);
 	if (ret != 0)
@@ -470,13 +3110,27 @@ static int k90_init_macro_functions(struct hid_device *dev)
 	ret = sysfs_create_group(&dev->dev.kobj, &k90_attr_group);
 	if (ret != 0)
 		goto fail_sysfs;
+	k90->macro_mode_kn = sysfs_get_dirent(dev->dev.kobj.sd, "macro_mode");
+	k90->current_profile_kn = sysfs_get_dirent(dev->dev.kobj.sd,
+						   "current_profile");
+	if (!k90->macro_mode_kn || !k90->current_profile_kn) {
+		ret = -ENODEV;
+		goto fail_dirent;
+	}
+
+	k90_init_recorder(drvdata);
 
 	return 0;
 
+fail_dirent:
+	sysfs_put(k90->macro_mode_kn);
+	sysfs_put(k90->current_profile_kn);
+	sysfs_remove_group(&dev->dev.kobj, &k90_attr_group);
 fail_sysfs:
 	k90->record_led.removed = true;
 	led_classdev_unregister(&k90->record_led.cdev);
-	cancel_work_sync(&k90->record_led.work);
+	cancel_delayed_work_sync(&k90->record_led.work);
+	k90_ctrl_flush(drvdata->ctrl);
 fail_record_led:
 	kfree(k90->record_led.cdev.name);
 fail_record_led_alloc:
@@ -486,16 +3140,33 @@ fail_drvdata:
 	return ret;
 }
 
-static void k90_cleanup_backlight(struct hid_device *dev)
+static void k90_cleanup_control(struct hid_device *dev)
 {
 	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
 
-	if (drvdata->backlight) {
-		drvdata->backlight->removed = true;
-		led_classdev_unregister(&drvdata->backlight->cdev);
-		cancel_work_sync(&drvdata->backlight->work);
-		kfree(drvdata->backlight->cdev.name);
-		kfree(drvdata->backlight);
+	if (drvdata->ctrl) {
+		destroy_workqueue(drvdata->wq);
+		k90_ctrl_cleanup(drvdata->ctrl);
+		kfree(drvdata->ctrl);
+	}
+}
+
+static void k90_cleanup_backlight(struct hid_device *dev)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	struct k90_led *backlight = drvdata->backlight;
+
+	if (backlight) {
+		/* Wait for the event callbacks still using the backlight */
+		WRITE_ONCE(drvdata->backlight, NULL);
+		synchronize_rcu();
+
+		backlight->removed = true;
+		led_classdev_unregister(&backlight->cdev);
+		cancel_delayed_work_sync(&backlight->work);
+		k90_ctrl_flush(drvdata->ctrl);
+		kfree(backlight->cdev.name);
+		kfree(backlight);
 	}
 }
 
@@ -503,15 +3174,30 @@ static void k90_cleanup_macro_functions(struct hid_device *dev)
 {
 	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
 	struct k90_drvdata *k90 = drvdata->k90;
+	int i;
 
 	if (k90) {
+		k90_stop_playback(k90);
+		k90_cleanup_recorder(drvdata);
+		/* Wait for the event callbacks still using k90 */
+		WRITE_ONCE(drvdata->k90, NULL);
+		synchronize_rcu();
+
+		sysfs_put(k90->macro_mode_kn);
+		sysfs_put(k90->current_profile_kn);
 		sysfs_remove_group(&dev->dev.kobj, &k90_attr_group);
 
 		k90->record_led.removed = true;
 		led_classdev_unregister(&k90->record_led.cdev);
-		cancel_work_sync(&k90->record_led.work);
+		cancel_delayed_work_sync(&k90->record_led.work);
+		k90_ctrl_flush(drvdata->ctrl);
 		kfree(k90->record_led.cdev.name);
 
+		kfree(k90->profile_report);
+		for (i = 0; i < K90_PROFILE_COUNT; i++) {
+			kfree(rcu_dereference_protected(k90->macros[i], 1));
+			kfree(rcu_dereference_protected(k90->bundles[i], 1));
+		}
 		kfree(k90);
 	}
 }
@@ -527,7 +3213,17 @@ static int corsair_probe(struct hid_device *dev, const struct hid_device_id *id)
 			       GFP_KERNEL);
 	if (drvdata == NULL)
 		return -ENOMEM;
+	drvdata->hdev = dev;
+	drvdata->usbdev = interface_to_usbdev(usbif);
+	drvdata->ifnum = usbif->cur_altsetting->desc.bInterfaceNumber;
 	drvdata->quirks = quirks;
+	mutex_init(&drvdata->status.lock);
+	mutex_init(&drvdata->mode.lock);
+	mutex_init(&drvdata->upload_lock);
+	drvdata->brightness = -1;
+	drvdata->current_profile = -1;
+	drvdata->macro_mode = -1;
+	INIT_WORK(&drvdata->init_work, k90_init_state_work);
 	hid_set_drvdata(dev, drvdata);
 
 	ret = hid_parse(dev);
@@ -541,7 +3237,23 @@ static int corsair_probe(struct hid_device *dev, const struct hid_device_id *id)
 		return ret;
 	}
 
-	if (usbif->cur_altsetting->desc.bInterfaceNumber == 0) {
+	/* The interface with the G-keys */
+	if (drvdata->input) {
+		ret = sysfs_create_group(&dev->dev.kobj,
+					 &corsair_keymap_attr_group);
+		if (ret != 0)
+			hid_warn(dev, "Failed to create keymap attributes.\n");
+		else
+			drvdata->keymap_attrs = true;
+	}
+
+	if (usbif->cur_altsetting->desc.bInterfaceNumber == 0 &&
+	    (quirks & (CORSAIR_USE_K90_MACRO | CORSAIR_USE_K90_BACKLIGHT))) {
+		ret = k90_init_control(dev);
+		if (ret != 0) {
+			hid_warn(dev, "Failed to initialize K90 control transfers.\n");
+			return 0;
+		}
 		if (quirks & CORSAIR_USE_K90_MACRO) {
 			ret = k90_init_macro_functions(dev);
 			if (ret != 0)
@@ -552,6 +3264,7 @@ static int corsair_probe(struct hid_device *dev, const struct hid_device_id *id)
 			if (ret != 0)
 				hid_warn(dev, "Failed to initialize K90 backlight.\n");
 		}
+		queue_work(drvdata->wq, &drvdata->init_work);
 	}
 
 	return 0;
@@ -559,26 +3272,172 @@ static int corsair_probe(struct hid_device *dev, const struct hid_device_id *id)
 
 static void corsair_remove(struct hid_device *dev)
 {
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+
+	cancel_work_sync(&drvdata->init_work);
+	debugfs_remove_recursive(drvdata->debugfs);
+	if (drvdata->keymap_attrs)
+		sysfs_remove_group(&dev->dev.kobj, &corsair_keymap_attr_group);
+
 	k90_cleanup_macro_functions(dev);
 	k90_cleanup_backlight(dev);
+	k90_cleanup_control(dev);
 
 	hid_hw_stop(dev);
 }
 
+#ifdef CONFIG_PM
+static int corsair_suspend(struct hid_device *dev, pm_message_t message)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	struct k90_drvdata *k90 = drvdata->k90;
+
+	if (!drvdata->ctrl)
+		return 0;
+
+	/* Send the pending LED updates now and wait for every request */
+	if (drvdata->backlight)
+		flush_delayed_work(&drvdata->backlight->work);
+	if (k90)
+		flush_delayed_work(&k90->record_led.work);
+	k90_ctrl_flush(drvdata->ctrl);
+
+	return 0;
+}
+
+static void k90_restore_complete(void *context, int result, const char *data)
+{
+	struct hid_device *hdev = context;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	if (result < 0)
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to restore state (error %d).\n", result);
+}
+
+static void k90_restore_request(struct hid_device *hdev, __u8 request,
+				__u16 value)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(hdev);
+	int ret;
+
+	ret = k90_ctrl_submit_wait(drvdata->ctrl, request, USB_DIR_OUT, value,
+				   0, NULL, 0, k90_restore_complete, hdev);
+	if (ret != 0)
+		k90_warn(drvdata->ctrl, &hdev->dev,
+			 "Failed to restore state (error %d).\n", ret);
+}
+
+/*
+ * Send the last known state back to the keyboard, without reading its
+ * status first. Values that were never known are left to the keyboard.
+ */
+static int corsair_resume(struct hid_device *dev)
+{
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	struct k90_drvdata *k90 = drvdata->k90;
+	int value;
+
+	if (!drvdata->ctrl)
+		return 0;
+
+	k90_invalidate_status(drvdata);
+	k90_invalidate_query(&drvdata->mode);
+
+	value = READ_ONCE(drvdata->current_profile);
+	if (value > 0)
+		k90_restore_request(dev, K90_REQUEST_PROFILE, value);
+	value = READ_ONCE(drvdata->macro_mode);
+	if (k90 && value >= 0)
+		k90_restore_request(dev, K90_REQUEST_MACRO_MODE, value);
+	/* The record LED is off after a reset */
+	if (k90 && k90->record_led.brightness)
+		k90_restore_request(dev, K90_REQUEST_MACRO_MODE,
+				    K90_MACRO_LED_ON);
+	value = READ_ONCE(drvdata->brightness);
+	if (drvdata->backlight && value >= 0)
+		k90_restore_request(dev, K90_REQUEST_BRIGHTNESS, value);
+
+	/* Readers may have missed changes while suspended */
+	k90_notify_current_profile(drvdata);
+	k90_notify_macro_mode(drvdata);
+
+	return 0;
+}
+#endif
+
 static int corsair_event(struct hid_device *dev, struct hid_field *field,
 			 struct hid_usage *usage, __s32 value)
 {
 	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	struct k90_drvdata *k90;
+	const struct corsair_usage_info *info;
+	struct k90_led *backlight;
 
-	if (!drvdata->k90)
+	/*
+	 * Special keys are only on interface 0, the other interfaces only
+	 * need their keys recorded while a macro is being recorded.
+	 */
+	if (drvdata->ifnum != 0) {
+		corsair_count_event(other);
+		if (drvdata->ifnum == K90_RECORD_IFNUM &&
+		    atomic_read(&k90_recordings) &&
+		    (usage->hid & HID_USAGE_PAGE) == HID_UP_KEYBOARD &&
+		    (usage->hid & HID_USAGE) <= 0xff)
+			k90_record_key(drvdata, usage->hid & HID_USAGE, value);
 		return 0;
+	}
 
-	switch (usage->hid & HID_USAGE) {
-	case CORSAIR_USAGE_MACRO_RECORD_START:
-		drvdata->k90->record_led.brightness = 1;
+	info = corsair_usage_info(usage->hid);
+	if (info->class == CORSAIR_CLASS_NONE) {
+		corsair_count_event(filtered);
+		return 0;
+	}
+	corsair_count_event(handled);
+	k90 = READ_ONCE(drvdata->k90);
+	trace_corsair_special_usage(dev, usage->hid & HID_USAGE, value);
+
+	switch (info->class) {
+	case CORSAIR_CLASS_GKEY:
+		/* Macros played by the driver replace the G-key events */
+		if (k90 && k90_play_gkey(drvdata, k90, info->index, value))
+			return 1;
+		break;
+	case CORSAIR_CLASS_RECORD:
+		if (k90) {
+			/* Index 0 is the start usage */
+			k90->record_led.brightness = !info->index;
+			if (value && info->index == 0)
+				k90_record_start(k90);
+			else if (value)
+				k90_record_stop(k90);
+		}
+		break;
+	case CORSAIR_CLASS_PROFILE:
+		/* The keyboard switches profile by itself */
+		if (value) {
+			int profile = info->index + 1;
+
+			k90_invalidate_status(drvdata);
+			if (xchg(&drvdata->current_profile, profile) != profile) {
+				k90_notify_current_profile(drvdata);
+				if (k90)
+					k90_release_players(k90);
+			}
+			if (k90)
+				k90_apply_bundle(dev, k90, profile);
+		}
 		break;
-	case CORSAIR_USAGE_MACRO_RECORD_STOP:
-		drvdata->k90->record_led.brightness = 0;
+	case CORSAIR_CLASS_LIGHT:
+		/* The Light key reports the new backlight level */
+		if (value) {
+			k90_invalidate_status(drvdata);
+			WRITE_ONCE(drvdata->brightness, info->index);
+			backlight = READ_ONCE(drvdata->backlight);
+			if (backlight)
+				led_classdev_notify_brightness_hw_changed(
+					&backlight->cdev, info->index);
+		}
 		break;
 	default:
 		break;
@@ -593,51 +3452,23 @@ static int corsair_input_mapping(struct hid_device *dev,
 				 struct hid_usage *usage, unsigned long **bit,
 				 int *max)
 {
-	int gkey;
+	struct corsair_drvdata *drvdata = hid_get_drvdata(dev);
+	const struct corsair_usage_info *info;
+	const unsigned short *keycodes;
 
-	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_KEYBOARD)
+	info = corsair_usage_info(usage->hid);
+	if (info->class == CORSAIR_CLASS_NONE)
 		return 0;
 
-	gkey = corsair_usage_to_gkey(usage->hid & HID_USAGE);
-	if (gkey != 0) {
-		hid_map_usage_clear(input, usage, bit, max, EV_KEY,
-				    corsair_gkey_map[gkey - 1]);
-		return 1;
-	}
-	if ((usage->hid & HID_USAGE) >= CORSAIR_USAGE_SPECIAL_MIN &&
-	    (usage->hid & HID_USAGE) <= CORSAIR_USAGE_SPECIAL_MAX) {
-		switch (usage->hid & HID_USAGE) {
-		case CORSAIR_USAGE_MACRO_RECORD_START:
-			hid_map_usage_clear(input, usage, bit, max, EV_KEY,
-					    corsair_record_keycodes[0]);
-			return 1;
-
-		case CORSAIR_USAGE_MACRO_RECORD_STOP:
-			hid_map_usage_clear(input, usage, bit, max, EV_KEY,
-					    corsair_record_keycodes[1]);
-			return 1;
-
-		case CORSAIR_USAGE_M1:
-			hid_map_usage_clear(input, usage, bit, max, EV_KEY,
-					    corsair_profile_keycodes[0]);
-			return 1;
-
-		case CORSAIR_USAGE_M2:
-			hid_map_usage_clear(input, usage, bit, max, EV_KEY,
-					    corsair_profile_keycodes[1]);
-			return 1;
-
-		case CORSAIR_USAGE_M3:
-			hid_map_usage_clear(input, usage, bit, max, EV_KEY,
-					    corsair_profile_keycodes[2]);
-			return 1;
-
-		default:
-			return -1;
-		}
-	}
+	keycodes = corsair_class_keycodes[info->class];
+	if (!keycodes)
+		return -1;
 
-	return 0;
+	if (info->class == CORSAIR_CLASS_GKEY)
+		drvdata->input = input->input;
+	hid_map_usage_clear(input, usage, bit, max, EV_KEY,
+			    keycodes[info->index]);
+	return 1;
 }
 
 static const struct hid_device_id corsair_devices[] = {
@@ -651,26 +3482,49 @@ MODULE_DEVICE_TABLE(hid, corsair_devices);
 
 static struct hid_driver corsair_driver = {
 	.name = "corsair",
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 	.id_table = corsair_devices,
 	.probe = corsair_probe,
 	.event = corsair_event,
 	.remove = corsair_remove,
 	.input_mapping = corsair_input_mapping,
+#ifdef CONFIG_PM
+	.suspend = corsair_suspend,
+	.resume = corsair_resume,
+	.reset_resume = corsair_resume,
+#endif
 };
 
 static int __init corsair_init(void)
 {
-	return hid_register_driver(&corsair_driver);
+	int ret;
+
+	corsair_debugfs_root = debugfs_create_dir("hid-corsair", NULL);
+	debugfs_create_file("events", 0444, corsair_debugfs_root, NULL,
+			    &corsair_events_fops);
+
+	ret = hid_register_driver(&corsair_driver);
+	if (ret != 0)
+		debugfs_remove_recursive(corsair_debugfs_root);
+
+	return ret;
 }
 
 static void corsair_exit(void)
 {
 	hid_unregister_driver(&corsair_driver);
+	debugfs_remove_recursive(corsair_debugfs_root);
 }
 
 module_init(corsair_init);
 module_exit(corsair_exit);
 
+#ifdef K90_KUNIT
+#include "hid-corsair-test.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Clement Vuchener");
 MODULE_DESCRIPTION("HID driver for Corsair devices");
@@ -0,0 +1,1130 @@
+/*
+ * Corsair Vengeance K90 emulator using raw_gadget
+ *
+ * Presents a K90 (1b1c:1b02) with its three HID interfaces on a UDC
+ * (dummy_udc by default) and answers the vendor requests described in
+ * control_messages.md. Lines read from stdin inject special key presses on
+ * interface 0. Sysfs attributes of the driver can be read or written in a
+ * loop once it is bound, and the throughput and latency percentiles of these
+ * operations are printed. Request counts are printed on exit.
+ *
+ * Build: gcc -O2 -Wall -pthread -o k90-emulator k90-emulator.c
+ * Usage: k90-emulator [-D driver] [-d device] [-l latency_us] [-g gap_us]
+ *                     [-r rate] [-n count] [-b read:path|write:path=values]
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/hid.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#define K90_VENDOR_ID	0x1b1c
+#define K90_PRODUCT_ID	0x1b02
+
+#define K90_INTERFACE_COUNT	3
+#define K90_REPORT_SIZE	8
+#define K90_PROFILE_COUNT	3
+#define K90_PROFILE_DATA_MAX	4096
+
+#define K90_REQUEST_MACRO_MODE	2
+#define K90_REQUEST_STATUS	4
+#define K90_REQUEST_GET_MODE	5
+#define K90_REQUEST_BINDINGS	16
+#define K90_REQUEST_MACRO_DATA	18
+#define K90_REQUEST_PROFILE	20
+#define K90_REQUEST_KEY_ROLES	22
+#define K90_REQUEST_BRIGHTNESS	49
+
+#define K90_MACRO_MODE_HW	0x01
+#define K90_MACRO_MODE_FW	0x10
+#define K90_MACRO_MODE_SW	0x30
+#define K90_MACRO_LED_ON	0x20
+#define K90_MACRO_LED_OFF	0x40
+
+#define EP0_MAX_DATA	4096
+
+/* Events of enum usb_raw_event_type missing from older headers */
+#define RAW_EVENT_RESET		5
+#define RAW_EVENT_DISCONNECT	6
+
+#define BENCH_MAX	8
+#define BENCH_VALUES_MAX	16
+
+struct ep0_io {
+	struct usb_raw_ep_io io;
+	char data[EP0_MAX_DATA];
+};
+
+struct control_event {
+	struct usb_raw_event event;
+	struct usb_ctrlrequest ctrl;
+};
+
+struct report_io {
+	struct usb_raw_ep_io io;
+	char data[K90_REPORT_SIZE];
+};
+
+/*
+ * Report descriptors
+ */
+
+/* Interface 0: special keys as keyboard usages (see hid_usage_codes.md) */
+static const uint8_t special_report_desc[] = {
+	0x05, 0x01,		/* Usage Page (Generic Desktop) */
+	0x09, 0x06,		/* Usage (Keyboard) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x05, 0x07,		/*  Usage Page (Keyboard) */
+	0x15, 0x00,		/*  Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*  Logical Maximum (255) */
+	0x19, 0x00,		/*  Usage Minimum (0) */
+	0x29, 0xff,		/*  Usage Maximum (255) */
+	0x75, 0x08,		/*  Report Size (8) */
+	0x95, K90_REPORT_SIZE,	/*  Report Count */
+	0x81, 0x00,		/*  Input (Data, Array) */
+	0xc0,			/* End Collection */
+};
+
+/* Interface 1: multimedia keys */
+static const uint8_t consumer_report_desc[] = {
+	0x05, 0x0c,		/* Usage Page (Consumer) */
+	0x09, 0x01,		/* Usage (Consumer Control) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x15, 0x00,		/*  Logical Minimum (0) */
+	0x26, 0xff, 0x03,	/*  Logical Maximum (1023) */
+	0x19, 0x00,		/*  Usage Minimum (0) */
+	0x2a, 0xff, 0x03,	/*  Usage Maximum (1023) */
+	0x75, 0x10,		/*  Report Size (16) */
+	0x95, 0x04,		/*  Report Count (4) */
+	0x81, 0x00,		/*  Input (Data, Array) */
+	0xc0,			/* End Collection */
+};
+
+/* Interface 2: regular keys, boot keyboard */
+static const uint8_t keyboard_report_desc[] = {
+	0x05, 0x01,		/* Usage Page (Generic Desktop) */
+	0x09, 0x06,		/* Usage (Keyboard) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x05, 0x07,		/*  Usage Page (Keyboard) */
+	0x19, 0xe0,		/*  Usage Minimum (Left Control) */
+	0x29, 0xe7,		/*  Usage Maximum (Right GUI) */
+	0x15, 0x00,		/*  Logical Minimum (0) */
+	0x25, 0x01,		/*  Logical Maximum (1) */
+	0x75, 0x01,		/*  Report Size (1) */
+	0x95, 0x08,		/*  Report Count (8) */
+	0x81, 0x02,		/*  Input (Data, Variable) */
+	0x95, 0x01,		/*  Report Count (1) */
+	0x75, 0x08,		/*  Report Size (8) */
+	0x81, 0x01,		/*  Input (Constant) */
+	0x05, 0x08,		/*  Usage Page (LEDs) */
+	0x19, 0x01,		/*  Usage Minimum (Num Lock) */
+	0x29, 0x05,		/*  Usage Maximum (Kana) */
+	0x95, 0x05,		/*  Report Count (5) */
+	0x75, 0x01,		/*  Report Size (1) */
+	0x91, 0x02,		/*  Output (Data, Variable) */
+	0x95, 0x01,		/*  Report Count (1) */
+	0x75, 0x03,		/*  Report Size (3) */
+	0x91, 0x01,		/*  Output (Constant) */
+	0x05, 0x07,		/*  Usage Page (Keyboard) */
+	0x19, 0x00,		/*  Usage Minimum (0) */
+	0x29, 0xff,		/*  Usage Maximum (255) */
+	0x15, 0x00,		/*  Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*  Logical Maximum (255) */
+	0x95, 0x06,		/*  Report Count (6) */
+	0x75, 0x08,		/*  Report Size (8) */
+	0x81, 0x00,		/*  Input (Data, Array) */
+	0xc0,			/* End Collection */
+};
+
+static const struct {
+	const uint8_t *data;
+	size_t size;
+} report_descs[K90_INTERFACE_COUNT] = {
+	{ special_report_desc, sizeof(special_report_desc) },
+	{ consumer_report_desc, sizeof(consumer_report_desc) },
+	{ keyboard_report_desc, sizeof(keyboard_report_desc) },
+};
+
+/*
+ * USB descriptors
+ */
+
+/* Multi-byte fields are set in little endian by build_config() */
+static struct usb_device_descriptor device_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bDeviceClass = 0,
+	.bMaxPacketSize0 = 64,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 0,
+	.bNumConfigurations = 1,
+};
+
+static const char *const strings[] = {
+	NULL,
+	"Corsair",
+	"Corsair K90 Vengeance Gaming Keyboard",
+};
+
+struct hid_class_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdHID;
+	uint8_t bCountryCode;
+	uint8_t bNumDescriptors;
+	uint8_t bReportDescriptorType;
+	uint16_t wDescriptorLength;
+} __attribute__((packed));
+
+struct interface_descs {
+	struct usb_interface_descriptor intf;
+	struct hid_class_descriptor hid;
+	struct usb_endpoint_descriptor ep;
+} __attribute__((packed));
+
+struct config_descs {
+	struct usb_config_descriptor config;
+	struct interface_descs intfs[K90_INTERFACE_COUNT];
+} __attribute__((packed));
+
+/*
+ * Emulator state
+ */
+
+struct k90_state {
+	pthread_mutex_t lock;
+	int brightness;
+	int profile;
+	int macro_mode;
+	bool record_led;
+	size_t profile_sizes[K90_PROFILE_COUNT][3];
+	uint8_t profile_data[K90_PROFILE_COUNT][3][K90_PROFILE_DATA_MAX];
+};
+
+struct k90_stats {
+	unsigned long requests[256];
+	unsigned long stalled[256];
+	unsigned long reports;
+};
+
+/* A sysfs attribute read or written in a loop by the benchmark thread */
+struct bench {
+	const char *pattern;	/* glob(3) pattern of the attribute */
+	bool write;
+	const char *values[BENCH_VALUES_MAX];	/* Written in turn */
+	int value_count;
+};
+
+static struct {
+	int fd;
+	const char *driver;
+	const char *device;
+	unsigned int latency_us;	/* Before answering a vendor request */
+	unsigned int gap_us;		/* Requests closer than this fail */
+	unsigned int rate;		/* Automatic G1 presses per second */
+	unsigned int bench_count;	/* Operations per benchmark */
+	struct bench benches[BENCH_MAX];
+	int bench_total;
+	struct config_descs config;
+	int ep_handles[K90_INTERFACE_COUNT];
+	atomic_bool configured;	/* Set by ep0, read by the other threads */
+	struct timespec last_request;
+	struct timespec start;
+	struct k90_state state;
+	struct k90_stats stats;
+	pthread_mutex_t report_lock;
+} emu = {
+	.driver = "dummy_udc",
+	.device = "dummy_udc.0",
+	.latency_us = 1000,
+	.bench_count = 1000,
+	.state = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.brightness = 3,
+		.profile = 1,
+		.macro_mode = K90_MACRO_MODE_HW,
+	},
+	.report_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static volatile sig_atomic_t stopping;
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static double elapsed_us(const struct timespec *from,
+			 const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e6 +
+	       (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static void sleep_us(unsigned int us)
+{
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000L,
+	};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR && !stopping)
+		;
+}
+
+/*
+ * raw_gadget helpers
+ */
+
+static int ep0_write(const void *data, size_t size)
+{
+	struct ep0_io io;
+
+	if (size > EP0_MAX_DATA)
+		size = EP0_MAX_DATA;
+	io.io.ep = 0;
+	io.io.flags = 0;
+	io.io.length = size;
+	memcpy(io.data, data, size);
+	return ioctl(emu.fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+}
+
+/* Read the data stage of an OUT request, also acknowledges it */
+static int ep0_read(void *data, size_t size)
+{
+	struct ep0_io io;
+	int ret;
+
+	if (size > EP0_MAX_DATA)
+		size = EP0_MAX_DATA;
+	io.io.ep = 0;
+	io.io.flags = 0;
+	io.io.length = size;
+	ret = ioctl(emu.fd, USB_RAW_IOCTL_EP0_READ, &io);
+	if (ret > 0 && data)
+		memcpy(data, io.data, ret);
+	return ret;
+}
+
+static void ep0_stall(void)
+{
+	if (ioctl(emu.fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+		perror("ep0 stall");
+}
+
+/* Pick an interrupt IN endpoint of the UDC for each interface */
+static void assign_endpoints(void)
+{
+	struct usb_raw_eps_info info;
+	bool used[USB_RAW_EPS_NUM_MAX] = { false };
+	int count, i, j, addr = 1;
+
+	memset(&info, 0, sizeof(info));
+	count = ioctl(emu.fd, USB_RAW_IOCTL_EPS_INFO, &info);
+	if (count < 0)
+		fail("eps info");
+
+	for (i = 0; i < K90_INTERFACE_COUNT; i++) {
+		for (j = 0; j < count; j++) {
+			if (used[j] || !info.eps[j].caps.type_int ||
+			    !info.eps[j].caps.dir_in)
+				continue;
+			used[j] = true;
+			if (info.eps[j].addr == USB_RAW_EP_ADDR_ANY)
+				emu.config.intfs[i].ep.bEndpointAddress =
+					USB_DIR_IN | addr++;
+			else
+				emu.config.intfs[i].ep.bEndpointAddress =
+					USB_DIR_IN | info.eps[j].addr;
+			break;
+		}
+		if (j == count) {
+			fprintf(stderr, "Not enough interrupt endpoints\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void build_config(void)
+{
+	struct config_descs *c = &emu.config;
+	int i;
+
+	device_desc.bcdUSB = htole16(0x0200);
+	device_desc.idVendor = htole16(K90_VENDOR_ID);
+	device_desc.idProduct = htole16(K90_PRODUCT_ID);
+	device_desc.bcdDevice = htole16(0x0100);
+
+	c->config.bLength = USB_DT_CONFIG_SIZE;
+	c->config.bDescriptorType = USB_DT_CONFIG;
+	c->config.wTotalLength = htole16(sizeof(*c));
+	c->config.bNumInterfaces = K90_INTERFACE_COUNT;
+	c->config.bConfigurationValue = 1;
+	c->config.bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_WAKEUP;
+	c->config.bMaxPower = 250;	/* 500 mA */
+
+	for (i = 0; i < K90_INTERFACE_COUNT; i++) {
+		c->intfs[i].intf.bLength = USB_DT_INTERFACE_SIZE;
+		c->intfs[i].intf.bDescriptorType = USB_DT_INTERFACE;
+		c->intfs[i].intf.bInterfaceNumber = i;
+		c->intfs[i].intf.bNumEndpoints = 1;
+		c->intfs[i].intf.bInterfaceClass = USB_CLASS_HID;
+		if (i == 2) {
+			c->intfs[i].intf.bInterfaceSubClass = 1; /* Boot */
+			c->intfs[i].intf.bInterfaceProtocol = 1; /* Keyboard */
+		}
+
+		c->intfs[i].hid.bLength = sizeof(struct hid_class_descriptor);
+		c->intfs[i].hid.bDescriptorType = HID_DT_HID;
+		c->intfs[i].hid.bcdHID = htole16(0x0111);
+		c->intfs[i].hid.bNumDescriptors = 1;
+		c->intfs[i].hid.bReportDescriptorType = HID_DT_REPORT;
+		c->intfs[i].hid.wDescriptorLength =
+			htole16(report_descs[i].size);
+
+		c->intfs[i].ep.bLength = USB_DT_ENDPOINT_SIZE;
+		c->intfs[i].ep.bDescriptorType = USB_DT_ENDPOINT;
+		c->intfs[i].ep.bmAttributes = USB_ENDPOINT_XFER_INT;
+		c->intfs[i].ep.wMaxPacketSize = htole16(K90_REPORT_SIZE);
+		c->intfs[i].ep.bInterval = 1;
+	}
+}
+
+/*
+ * Control requests
+ *
+ * The handlers are given the setup packet with wValue, wIndex and wLength
+ * already converted to host byte order by handle_control().
+ */
+
+static void get_descriptor(const struct usb_ctrlrequest *ctrl)
+{
+	uint8_t type = ctrl->wValue >> 8, index = ctrl->wValue & 0xff;
+	size_t len = ctrl->wLength;
+	uint8_t buf[256];
+	const char *s;
+	int i;
+
+	switch (type) {
+	case USB_DT_DEVICE:
+		ep0_write(&device_desc, len < sizeof(device_desc) ?
+					len : sizeof(device_desc));
+		return;
+	case USB_DT_CONFIG:
+		ep0_write(&emu.config, len < sizeof(emu.config) ?
+				       len : sizeof(emu.config));
+		return;
+	case USB_DT_STRING:
+		if (index == 0) {
+			buf[0] = 4;
+			buf[1] = USB_DT_STRING;
+			buf[2] = 0x09;	/* English (US) */
+			buf[3] = 0x04;
+		} else if (index < sizeof(strings) / sizeof(strings[0])) {
+			s = strings[index];
+			buf[0] = 2 + 2 * strlen(s);
+			buf[1] = USB_DT_STRING;
+			for (i = 0; s[i]; i++) {
+				buf[2 + 2 * i] = s[i];
+				buf[3 + 2 * i] = 0;
+			}
+		} else {
+			break;
+		}
+		ep0_write(buf, len < buf[0] ? len : buf[0]);
+		return;
+	case HID_DT_REPORT:
+		if (ctrl->wIndex >= K90_INTERFACE_COUNT)
+			break;
+		ep0_write(report_descs[ctrl->wIndex].data,
+			  len < report_descs[ctrl->wIndex].size ?
+			  len : report_descs[ctrl->wIndex].size);
+		return;
+	default:
+		break;
+	}
+	ep0_stall();
+}
+
+static void set_configuration(const struct usb_ctrlrequest *ctrl)
+{
+	int i;
+
+	if (!atomic_load(&emu.configured)) {
+		for (i = 0; i < K90_INTERFACE_COUNT; i++) {
+			emu.ep_handles[i] = ioctl(emu.fd,
+						  USB_RAW_IOCTL_EP_ENABLE,
+						  &emu.config.intfs[i].ep);
+			if (emu.ep_handles[i] < 0)
+				fail("ep enable");
+		}
+		if (ioctl(emu.fd, USB_RAW_IOCTL_VBUS_DRAW,
+			  emu.config.config.bMaxPower) < 0)
+			fail("vbus draw");
+		if (ioctl(emu.fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+			fail("configure");
+		atomic_store(&emu.configured, true);
+		fprintf(stderr, "Configured\n");
+	}
+	ep0_read(NULL, 0);
+}
+
+/*
+ * After a bus reset or a disconnection, the host enumerates the keyboard
+ * again: the endpoints are enabled again by the next SET_CONFIGURATION.
+ * Like the keyboard, the state kept in RAM is lost but not the profiles.
+ */
+static void reset_device(const char *why)
+{
+	struct k90_state *s = &emu.state;
+	int i;
+
+	if (atomic_exchange(&emu.configured, false)) {
+		/* Wait for the report being sent, it fails with the reset */
+		pthread_mutex_lock(&emu.report_lock);
+		for (i = 0; i < K90_INTERFACE_COUNT; i++) {
+			if (ioctl(emu.fd, USB_RAW_IOCTL_EP_DISABLE,
+				  emu.ep_handles[i]) < 0)
+				perror("ep disable");
+			emu.ep_handles[i] = -1;
+		}
+		pthread_mutex_unlock(&emu.report_lock);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->brightness = 3;
+	s->profile = 1;
+	s->macro_mode = K90_MACRO_MODE_HW;
+	s->record_led = false;
+	pthread_mutex_unlock(&s->lock);
+	memset(&emu.last_request, 0, sizeof(emu.last_request));
+
+	fprintf(stderr, "%s\n", why);
+}
+
+static void handle_standard(const struct usb_ctrlrequest *ctrl)
+{
+	uint8_t zero[2] = { 0, 0 };
+
+	switch (ctrl->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		get_descriptor(ctrl);
+		break;
+	case USB_REQ_SET_CONFIGURATION:
+		set_configuration(ctrl);
+		break;
+	case USB_REQ_GET_CONFIGURATION:
+		zero[0] = atomic_load(&emu.configured);
+		ep0_write(zero, 1);
+		break;
+	case USB_REQ_GET_STATUS:
+		ep0_write(zero, ctrl->wLength < 2 ? ctrl->wLength : 2);
+		break;
+	case USB_REQ_SET_INTERFACE:
+	case USB_REQ_SET_FEATURE:
+	case USB_REQ_CLEAR_FEATURE:
+		ep0_read(NULL, 0);
+		break;
+	default:
+		ep0_stall();
+		break;
+	}
+}
+
+static void handle_class(const struct usb_ctrlrequest *ctrl)
+{
+	uint8_t report[K90_REPORT_SIZE] = { 0 };
+
+	switch (ctrl->bRequest) {
+	case HID_REQ_SET_IDLE:
+	case HID_REQ_SET_PROTOCOL:
+	case HID_REQ_SET_REPORT:
+		ep0_read(NULL, ctrl->wLength);
+		break;
+	case HID_REQ_GET_REPORT:
+		ep0_write(report, ctrl->wLength < sizeof(report) ?
+				  ctrl->wLength : sizeof(report));
+		break;
+	default:
+		ep0_stall();
+		break;
+	}
+}
+
+static bool handle_vendor_out(const struct usb_ctrlrequest *ctrl)
+{
+	struct k90_state *s = &emu.state;
+	uint8_t data[EP0_MAX_DATA];
+	int slot, len;
+
+	switch (ctrl->bRequest) {
+	case K90_REQUEST_MACRO_MODE:
+		switch (ctrl->wValue) {
+		case K90_MACRO_MODE_HW:
+		case K90_MACRO_MODE_FW:
+		case K90_MACRO_MODE_SW:
+			s->macro_mode = ctrl->wValue;
+			break;
+		case K90_MACRO_LED_ON:
+			s->record_led = true;
+			break;
+		case K90_MACRO_LED_OFF:
+			s->record_led = false;
+			break;
+		default:
+			return false;
+		}
+		break;
+	case K90_REQUEST_PROFILE:
+		if (ctrl->wValue < 1 || ctrl->wValue > K90_PROFILE_COUNT)
+			return false;
+		s->profile = ctrl->wValue;
+		break;
+	case K90_REQUEST_BRIGHTNESS:
+		if (ctrl->wValue > 3)
+			return false;
+		s->brightness = ctrl->wValue;
+		break;
+	case K90_REQUEST_BINDINGS:
+	case K90_REQUEST_MACRO_DATA:
+	case K90_REQUEST_KEY_ROLES:
+		if (ctrl->wIndex < 1 || ctrl->wIndex > K90_PROFILE_COUNT ||
+		    ctrl->wLength > K90_PROFILE_DATA_MAX)
+			return false;
+		slot = ctrl->bRequest == K90_REQUEST_BINDINGS ? 0 :
+		       ctrl->bRequest == K90_REQUEST_MACRO_DATA ? 1 : 2;
+		len = ep0_read(data, ctrl->wLength);
+		if (len < 0)
+			return true;
+		memcpy(s->profile_data[ctrl->wIndex - 1][slot], data, len);
+		s->profile_sizes[ctrl->wIndex - 1][slot] = len;
+		return true;
+	default:
+		return false;
+	}
+
+	ep0_read(NULL, 0);
+	return true;
+}
+
+static bool handle_vendor_in(const struct usb_ctrlrequest *ctrl)
+{
+	struct k90_state *s = &emu.state;
+	uint8_t data[8];
+	size_t len;
+
+	switch (ctrl->bRequest) {
+	case K90_REQUEST_STATUS:
+		memset(data, 0, sizeof(data));
+		data[0] = 0x01;
+		data[1] = 0x01;
+		data[4] = s->brightness;
+		data[6] = 0x01;
+		data[7] = s->profile;
+		len = 8;
+		break;
+	case K90_REQUEST_GET_MODE:
+		data[0] = s->macro_mode;
+		data[1] = 0x01;
+		len = 2;
+		break;
+	default:
+		return false;
+	}
+
+	ep0_write(data, ctrl->wLength < len ? ctrl->wLength : len);
+	return true;
+}
+
+static void handle_vendor(const struct usb_ctrlrequest *ctrl)
+{
+	struct timespec now;
+	bool handled;
+
+	emu.stats.requests[ctrl->bRequest]++;
+
+	/* The keyboard fails requests sent too quickly after another */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (emu.gap_us &&
+	    elapsed_us(&emu.last_request, &now) < emu.gap_us) {
+		emu.stats.stalled[ctrl->bRequest]++;
+		emu.last_request = now;
+		ep0_stall();
+		return;
+	}
+
+	sleep_us(emu.latency_us);
+
+	pthread_mutex_lock(&emu.state.lock);
+	if (ctrl->bRequestType & USB_DIR_IN)
+		handled = handle_vendor_in(ctrl);
+	else
+		handled = handle_vendor_out(ctrl);
+	pthread_mutex_unlock(&emu.state.lock);
+
+	if (!handled) {
+		emu.stats.stalled[ctrl->bRequest]++;
+		ep0_stall();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &emu.last_request);
+}
+
+static void handle_control(const struct usb_ctrlrequest *setup)
+{
+	struct usb_ctrlrequest ctrl = *setup;
+
+	ctrl.wValue = le16toh(setup->wValue);
+	ctrl.wIndex = le16toh(setup->wIndex);
+	ctrl.wLength = le16toh(setup->wLength);
+
+	switch (ctrl.bRequestType & USB_TYPE_MASK) {
+	case USB_TYPE_STANDARD:
+		handle_standard(&ctrl);
+		break;
+	case USB_TYPE_CLASS:
+		handle_class(&ctrl);
+		break;
+	case USB_TYPE_VENDOR:
+		handle_vendor(&ctrl);
+		break;
+	default:
+		ep0_stall();
+		break;
+	}
+}
+
+/*
+ * Special key injection
+ */
+
+static int send_report(const uint8_t *report)
+{
+	struct report_io io;
+	int ret;
+
+	io.io.ep = emu.ep_handles[0];
+	io.io.flags = 0;
+	io.io.length = K90_REPORT_SIZE;
+	memcpy(io.data, report, K90_REPORT_SIZE);
+
+	pthread_mutex_lock(&emu.report_lock);
+	ret = ioctl(emu.fd, USB_RAW_IOCTL_EP_WRITE, &io);
+	if (ret >= 0)
+		emu.stats.reports++;
+	pthread_mutex_unlock(&emu.report_lock);
+
+	return ret;
+}
+
+static int press_usage(uint8_t usage)
+{
+	uint8_t report[K90_REPORT_SIZE] = { usage };
+	uint8_t release[K90_REPORT_SIZE] = { 0 };
+
+	if (send_report(report) < 0 || send_report(release) < 0)
+		return -1;
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	uint8_t usage;
+} key_names[] = {
+	{ "m1", 0xf1 }, { "m2", 0xf2 }, { "m3", 0xf3 },
+	{ "mr-start", 0xf6 }, { "mr-stop", 0xf7 },
+	{ "light-off", 0xfa }, { "light-dim", 0xfb },
+	{ "light-medium", 0xfc }, { "light-bright", 0xfd },
+};
+
+/* G1..G18, a name from key_names or a hexadecimal usage */
+static int parse_key(const char *name)
+{
+	unsigned long usage;
+	char *end;
+	int i;
+
+	if ((name[0] == 'g' || name[0] == 'G') && name[1]) {
+		i = strtol(name + 1, &end, 10);
+		if (*end == '\0' && i >= 1 && i <= 18)
+			return i <= 16 ? 0xd0 + i - 1 : 0xe8 + i - 17;
+	}
+	for (i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++)
+		if (strcmp(name, key_names[i].name) == 0)
+			return key_names[i].usage;
+	usage = strtoul(name, &end, 16);
+	if (*end == '\0' && end != name && usage <= 0xff)
+		return usage;
+	return -1;
+}
+
+static void *input_thread(void *arg)
+{
+	char line[64];
+	int usage;
+
+	while (!stopping && fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, " \t\r\n")] = '\0';
+		if (line[0] == '\0')
+			continue;
+		usage = parse_key(line);
+		if (usage < 0) {
+			fprintf(stderr, "Unknown key: %s\n", line);
+			continue;
+		}
+		if (!atomic_load(&emu.configured)) {
+			fprintf(stderr, "Not configured yet\n");
+			continue;
+		}
+		if (press_usage(usage) < 0)
+			perror("report");
+	}
+	return NULL;
+}
+
+/* Press G1 at a fixed rate, for benchmarking the event path */
+static void *rate_thread(void *arg)
+{
+	unsigned int period_us = 1000000 / emu.rate;
+
+	while (!stopping) {
+		if (atomic_load(&emu.configured) && press_usage(0xd0) < 0)
+			perror("report");
+		sleep_us(period_us);
+	}
+	return NULL;
+}
+
+/*
+ * Sysfs benchmark
+ */
+
+/* "read:path" or "write:path=value[,value...]" */
+static void parse_bench(char *spec)
+{
+	struct bench *b;
+	char *values, *value;
+
+	if (emu.bench_total == BENCH_MAX) {
+		fprintf(stderr, "Too many benchmarks\n");
+		exit(EXIT_FAILURE);
+	}
+	b = &emu.benches[emu.bench_total];
+
+	if (strncmp(spec, "read:", 5) == 0) {
+		b->pattern = spec + 5;
+	} else if (strncmp(spec, "write:", 6) == 0) {
+		b->pattern = spec + 6;
+		b->write = true;
+		/* Sysfs paths have no "=", values may (e.g. for state) */
+		values = strchr(b->pattern, '=');
+		if (!values) {
+			fprintf(stderr, "No value to write: %s\n", spec);
+			exit(EXIT_FAILURE);
+		}
+		*values++ = '\0';
+		while ((value = strsep(&values, ",")) != NULL &&
+		       b->value_count < BENCH_VALUES_MAX)
+			b->values[b->value_count++] = value;
+	} else {
+		fprintf(stderr, "Invalid benchmark: %s\n", spec);
+		exit(EXIT_FAILURE);
+	}
+	emu.bench_total++;
+}
+
+/* Wait for the driver to create the attribute */
+static char *bench_path(const struct bench *b)
+{
+	glob_t g;
+	char *path = NULL;
+
+	while (!stopping && !path) {
+		if (glob(b->pattern, 0, NULL, &g) == 0) {
+			path = strdup(g.gl_pathv[0]);
+			globfree(&g);
+		} else {
+			sleep_us(100000);
+		}
+	}
+	return path;
+}
+
+/* Time of one read or write of the attribute, negative on error */
+static double bench_op(const struct bench *b, const char *path,
+		       unsigned int i)
+{
+	struct timespec before, after;
+	char buf[4096];
+	const char *value;
+	ssize_t ret;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	fd = open(path, b->write ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (b->write) {
+		value = b->values[i % b->value_count];
+		ret = write(fd, value, strlen(value));
+	} else {
+		ret = read(fd, buf, sizeof(buf));
+	}
+	close(fd);
+	clock_gettime(CLOCK_MONOTONIC, &after);
+
+	return ret < 0 ? -1 : elapsed_us(&before, &after);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted values */
+static double percentile(const double *sorted, unsigned int n, double p)
+{
+	unsigned int rank = (unsigned int)(p * n + 0.999999);
+
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void run_bench(const struct bench *b)
+{
+	struct timespec start, end;
+	double *latencies, seconds;
+	unsigned int i, n = 0, errors = 0;
+	char *path;
+	double us;
+
+	path = bench_path(b);
+	if (!path)
+		return;
+	latencies = calloc(emu.bench_count, sizeof(double));
+	if (!latencies)
+		fail("calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < emu.bench_count && !stopping; i++) {
+		us = bench_op(b, path, i);
+		if (us < 0)
+			errors++;
+		else
+			latencies[n++] = us;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = elapsed_us(&start, &end) / 1e6;
+
+	if (n > 0) {
+		qsort(latencies, n, sizeof(double), compare_double);
+		fprintf(stderr, "%s %s: %u ops, %.1f ops/s, p50 %.1f us, "
+			"p99 %.1f us, max %.1f us, %u errors\n",
+			b->write ? "write" : "read", path, n,
+			(n + errors) / seconds,
+			percentile(latencies, n, 0.50),
+			percentile(latencies, n, 0.99),
+			latencies[n - 1], errors);
+	} else {
+		fprintf(stderr, "%s %s: %u errors\n",
+			b->write ? "write" : "read", path, errors);
+	}
+	free(latencies);
+	free(path);
+}
+
+static void *bench_thread(void *arg)
+{
+	int i;
+
+	while (!stopping && !atomic_load(&emu.configured))
+		sleep_us(100000);
+	for (i = 0; i < emu.bench_total && !stopping; i++)
+		run_bench(&emu.benches[i]);
+	return NULL;
+}
+
+/*
+ * Main loop
+ */
+
+static void print_stats(void)
+{
+	struct timespec now;
+	double seconds;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	seconds = elapsed_us(&emu.start, &now) / 1e6;
+
+	fprintf(stderr, "%-8s %10s %10s %10s\n",
+		"request", "count", "stalled", "per sec");
+	for (i = 0; i < 256; i++) {
+		if (!emu.stats.requests[i])
+			continue;
+		fprintf(stderr, "%-8d %10lu %10lu %10.1f\n", i,
+			emu.stats.requests[i], emu.stats.stalled[i],
+			emu.stats.requests[i] / seconds);
+	}
+	fprintf(stderr, "reports: %lu (%.1f per sec)\n", emu.stats.reports,
+		emu.stats.reports / seconds);
+	pthread_mutex_lock(&emu.state.lock);
+	fprintf(stderr, "state: brightness %d, profile %d, mode 0x%02x, "
+		"record LED %s\n", emu.state.brightness, emu.state.profile,
+		emu.state.macro_mode, emu.state.record_led ? "on" : "off");
+	pthread_mutex_unlock(&emu.state.lock);
+}
+
+static void on_signal(int sig)
+{
+	stopping = 1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-D driver] [-d device] [-l latency_us] "
+		"[-g gap_us] [-r rate] [-n count]\n"
+		"          [-b read:path|write:path=value[,value...]]...\n"
+		"  -D  UDC driver name (default dummy_udc)\n"
+		"  -d  UDC device name (default dummy_udc.0)\n"
+		"  -l  time to answer each vendor request (default 1000)\n"
+		"  -g  stall vendor requests sent less than gap_us after the\n"
+		"      previous one (default 0, disabled)\n"
+		"  -r  press G1 rate times per second (default 0, disabled)\n"
+		"  -b  read or write a sysfs attribute (glob pattern) count\n"
+		"      times once it exists, cycling through the values, and\n"
+		"      print ops/s and latency percentiles\n"
+		"  -n  operations per -b benchmark (default 1000)\n"
+		"Keys read from stdin (g1..g18, m1..m3, mr-start, mr-stop,\n"
+		"light-off..light-bright or a hexadecimal usage) are pressed\n"
+		"and released on interface 0.\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct usb_raw_init init;
+	struct control_event ev;
+	struct sigaction sa;
+	pthread_t thread;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "D:d:l:g:r:n:b:h")) != -1) {
+		switch (opt) {
+		case 'D':
+			emu.driver = optarg;
+			break;
+		case 'd':
+			emu.device = optarg;
+			break;
+		case 'l':
+			emu.latency_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			emu.gap_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			emu.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			emu.bench_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			parse_bench(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* No SA_RESTART: the blocking ioctls return on signals */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	emu.fd = open("/dev/raw-gadget", O_RDWR);
+	if (emu.fd < 0)
+		fail("open /dev/raw-gadget");
+
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, emu.driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, emu.device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_HIGH;
+	if (ioctl(emu.fd, USB_RAW_IOCTL_INIT, &init) < 0)
+		fail("init");
+	if (ioctl(emu.fd, USB_RAW_IOCTL_RUN, 0) < 0)
+		fail("run");
+
+	build_config();
+	clock_gettime(CLOCK_MONOTONIC, &emu.start);
+
+	if (pthread_create(&thread, NULL, input_thread, NULL) != 0)
+		fail("input thread");
+	pthread_detach(thread);
+	if (emu.rate) {
+		if (pthread_create(&thread, NULL, rate_thread, NULL) != 0)
+			fail("rate thread");
+		pthread_detach(thread);
+	}
+	if (emu.bench_total && emu.bench_count) {
+		if (pthread_create(&thread, NULL, bench_thread, NULL) != 0)
+			fail("bench thread");
+		pthread_detach(thread);
+	}
+
+	while (!stopping) {
+		ev.event.type = 0;
+		ev.event.length = sizeof(ev.ctrl);
+		if (ioctl(emu.fd, USB_RAW_IOCTL_EVENT_FETCH, &ev) < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("event fetch");
+		}
+
+		switch (ev.event.type) {
+		case USB_RAW_EVENT_CONNECT:
+			assign_endpoints();
+			break;
+		case USB_RAW_EVENT_CONTROL:
+			handle_control(&ev.ctrl);
+			break;
+		case RAW_EVENT_RESET:
+			reset_device("Reset");
+			break;
+		case RAW_EVENT_DISCONNECT:
+			reset_device("Disconnected");
+			break;
+		default:
+			break;
+		}
+	}
+
+	print_stats();
+	return EXIT_SUCCESS;
+}